@@ -23,6 +23,28 @@ T hi_atomic_cas(T* ptr, T oldval, T newval)
   If the current value of *ptr is oldval, then write newval into *ptr. Returns the contents of
   *ptr before the operation.
 
+The above are sequentially consistent. The following take a memory order, one of
+HI_ATOMIC_RELAXED, HI_ATOMIC_ACQUIRE, HI_ATOMIC_RELEASE, HI_ATOMIC_ACQ_REL and HI_ATOMIC_SEQ_CST,
+with the same meaning as the orders of C++11 <atomic>. Where the compiler lacks support for
+ordered atomics they fall back to full barriers.
+
+T hi_atomic_load(T* ptr, order)
+void hi_atomic_store(T* ptr, T value, order)
+  Atomically read or write *ptr
+
+T hi_atomic_add_fetch_explicit(T* operand, T delta, order)
+T hi_atomic_sub_fetch_explicit(T* operand, T delta, order)
+  Like hi_atomic_add_fetch and hi_atomic_sub_fetch
+
+T hi_atomic_exchange(T* ptr, T value, order)
+  Like hi_atomic_swap
+
+bool hi_atomic_cas_bool_explicit(T* ptr, T oldval, T newval, order)
+  Like hi_atomic_cas_bool. A failed exchange is relaxed. C++ only.
+
+void hi_atomic_fence(order)
+  Memory fence
+
 -----------------------------------------------------------------------------*/
 
 #ifndef _HI_INDIRECT_INCLUDE_
@@ -30,6 +52,8 @@ T hi_atomic_cas(T* ptr, T oldval, T newval)
 #endif
 
 #define _HI_ATOMIC_HAS_SYNC_BUILTINS defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 4))
+#define _HI_ATOMIC_HAS_ATOMIC_BUILTINS defined(__clang__) || \
+  (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7)))
 
 // T hi_atomic_swap(T *ptr, T value)
 #if HI_WITHOUT_SMP
@@ -57,6 +81,9 @@ T hi_atomic_cas(T* ptr, T oldval, T newval)
 // void hi_atomic_add32(T* operand, T delta)
 #if HI_WITHOUT_SMP
   #define hi_atomic_add32(operand, delta) (*(operand) += (delta))
+#elif _HI_ATOMIC_HAS_ATOMIC_BUILTINS
+  #define hi_atomic_add32(operand, delta) \
+    ((void)__atomic_add_fetch((operand), (delta), __ATOMIC_SEQ_CST))
 #elif HI_TARGET_ARCH_X64 || HI_TARGET_ARCH_X86
   inline static void HI_UNUSED hi_atomic_add32(int32_t* operand, int32_t delta) {
     // From http://www.memoryhole.net/kyle/2007/05/atomic_incrementing.html
@@ -83,6 +110,9 @@ T hi_atomic_cas(T* ptr, T oldval, T newval)
 // T hi_atomic_sub_fetch(T* operand, T delta)
 #if HI_WITHOUT_SMP
   #define hi_atomic_sub_fetch(operand, delta) (*(operand) -= (delta))
+#elif _HI_ATOMIC_HAS_ATOMIC_BUILTINS
+  #define hi_atomic_sub_fetch(operand, delta) \
+    __atomic_sub_fetch((operand), (delta), __ATOMIC_SEQ_CST)
 #elif _HI_ATOMIC_HAS_SYNC_BUILTINS
   #define hi_atomic_sub_fetch __sync_sub_and_fetch
 #else
@@ -92,6 +122,9 @@ T hi_atomic_cas(T* ptr, T oldval, T newval)
 // T hi_atomic_add_fetch(T* operand, T delta)
 #if HI_WITHOUT_SMP
   #define hi_atomic_add_fetch(operand, delta) (*(operand) += (delta))
+#elif _HI_ATOMIC_HAS_ATOMIC_BUILTINS
+  #define hi_atomic_add_fetch(operand, delta) \
+    __atomic_add_fetch((operand), (delta), __ATOMIC_SEQ_CST)
 #elif _HI_ATOMIC_HAS_SYNC_BUILTINS
   #define hi_atomic_add_fetch __sync_add_and_fetch
 #else
@@ -133,7 +166,116 @@ T hi_atomic_cas(T* ptr, T oldval, T newval)
 #endif
 
 
+// Memory orders
+#if _HI_ATOMIC_HAS_ATOMIC_BUILTINS
+  #define HI_ATOMIC_RELAXED __ATOMIC_RELAXED
+  #define HI_ATOMIC_ACQUIRE __ATOMIC_ACQUIRE
+  #define HI_ATOMIC_RELEASE __ATOMIC_RELEASE
+  #define HI_ATOMIC_ACQ_REL __ATOMIC_ACQ_REL
+  #define HI_ATOMIC_SEQ_CST __ATOMIC_SEQ_CST
+#else
+  #define HI_ATOMIC_RELAXED 0
+  #define HI_ATOMIC_ACQUIRE 2
+  #define HI_ATOMIC_RELEASE 3
+  #define HI_ATOMIC_ACQ_REL 4
+  #define HI_ATOMIC_SEQ_CST 5
+#endif
+
+// T hi_atomic_load(T* ptr, order)
+// void hi_atomic_store(T* ptr, T value, order)
+#if HI_WITHOUT_SMP
+  #define hi_atomic_load(ptr, order) (*(ptr))
+  #define hi_atomic_store(ptr, value, order) (*(ptr) = (value))
+#elif _HI_ATOMIC_HAS_ATOMIC_BUILTINS
+  #define hi_atomic_load(ptr, order) __atomic_load_n((ptr), (order))
+  #define hi_atomic_store(ptr, value, order) __atomic_store_n((ptr), (value), (order))
+#elif _HI_ATOMIC_HAS_SYNC_BUILTINS
+  #define hi_atomic_load(ptr, order) \
+    ({ __typeof__(*(ptr)) v = *(ptr); __sync_synchronize(); v; })
+  #define hi_atomic_store(ptr, value, order) \
+    do { __sync_synchronize(); *(ptr) = (value); __sync_synchronize(); } while (0)
+#else
+  #error "Unsupported compiler: Missing support for atomic operations"
+#endif
+
+// T hi_atomic_add_fetch_explicit(T* operand, T delta, order)
+// T hi_atomic_sub_fetch_explicit(T* operand, T delta, order)
+#if HI_WITHOUT_SMP
+  #define hi_atomic_add_fetch_explicit(operand, delta, order) (*(operand) += (delta))
+  #define hi_atomic_sub_fetch_explicit(operand, delta, order) (*(operand) -= (delta))
+#elif _HI_ATOMIC_HAS_ATOMIC_BUILTINS
+  #define hi_atomic_add_fetch_explicit(operand, delta, order) \
+    __atomic_add_fetch((operand), (delta), (order))
+  #define hi_atomic_sub_fetch_explicit(operand, delta, order) \
+    __atomic_sub_fetch((operand), (delta), (order))
+#elif _HI_ATOMIC_HAS_SYNC_BUILTINS
+  #define hi_atomic_add_fetch_explicit(operand, delta, order) \
+    __sync_add_and_fetch((operand), (delta))
+  #define hi_atomic_sub_fetch_explicit(operand, delta, order) \
+    __sync_sub_and_fetch((operand), (delta))
+#else
+  #error "Unsupported compiler: Missing support for atomic operations"
+#endif
+
+// T hi_atomic_exchange(T* ptr, T value, order)
+#if HI_WITHOUT_SMP
+  #define hi_atomic_exchange(ptr, value, order) hi_atomic_swap((ptr), (value))
+#elif _HI_ATOMIC_HAS_ATOMIC_BUILTINS
+  #define hi_atomic_exchange(ptr, value, order) __atomic_exchange_n((ptr), (value), (order))
+#else
+  #define hi_atomic_exchange(ptr, value, order) hi_atomic_swap((ptr), (value))
+#endif
+
+// bool hi_atomic_cas_bool_explicit(T* ptr, T oldval, T newval, order)
+#ifdef __cplusplus
+  template <typename T, typename V> inline static bool HI_UNUSED
+  hi_atomic_cas_bool_explicit(volatile T* ptr, V oldval, V newval, int order) {
+  #if HI_WITHOUT_SMP
+    return (*ptr == (T)oldval) && ((*ptr = (T)newval), true);
+  #elif _HI_ATOMIC_HAS_ATOMIC_BUILTINS
+    T expected = (T)oldval;
+    return __atomic_compare_exchange_n(ptr, &expected, (T)newval, /*weak=*/false, order,
+                                       __ATOMIC_RELAXED);
+  #else
+    return __sync_bool_compare_and_swap(ptr, (T)oldval, (T)newval);
+  #endif
+  }
+#endif
+
+// void hi_atomic_fence(order)
+#if HI_WITHOUT_SMP
+  #define hi_atomic_fence(order) do{}while(0)
+#elif _HI_ATOMIC_HAS_ATOMIC_BUILTINS
+  #define hi_atomic_fence(order) __atomic_thread_fence(order)
+#else
+  #define hi_atomic_fence(order) __sync_synchronize()
+#endif
+
+// void hi_cpu_relax()
+//   Hint to the CPU that we're busy-waiting, e.g. to let another hyperthread of the core run
+#if HI_TARGET_ARCH_X64 || HI_TARGET_ARCH_X86
+  #define hi_cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+#elif defined(__aarch64__) || HI_TARGET_ARCH_ARM
+  #define hi_cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+  #define hi_cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+
 // Spinlock
+//   Test-and-test-and-set lock for short critical sections. An uncontended lock and unlock is one
+//   compare-and-swap and one exchange. When the lock is taken, the locker spins with exponential
+//   backoff for a while and then sleeps until woken by unlock(), in a futex on Linux and otherwise
+//   by yielding the CPU. The value is 0 when unlocked, 1 when locked and 2 when locked and
+//   threads might be sleeping on it.
+//
+// TicketLock
+//   Fair lock: lockers get the lock in the order they asked for it. Waiters spin with backoff
+//   proportional to their distance from the head of the line and yield the CPU after a while.
+//   When there are more lockers than cores, every handover waits for the next locker in line to
+//   be scheduled, so prefer Spinlock unless some lockers would otherwise starve.
+//
+// Both count contended acquisitions process-wide, see spinlock_stats().
 #ifdef __cplusplus
 namespace hi {
 typedef volatile int32_t Spinlock;
@@ -148,6 +290,9 @@ bool spinlock_try_lock(Spinlock* lock);
 void spinlock_lock(Spinlock* lock);
 void spinlock_unlock(Spinlock* lock);
 
+void _spinlock_lock_contended(Spinlock& lock);
+void _spinlock_wake(Spinlock& lock);
+
 struct ScopedSpinlock {
   ScopedSpinlock(Spinlock& lock) : _lock(lock) { spinlock_lock(_lock); }
   ~ScopedSpinlock() { spinlock_unlock(_lock); }
@@ -156,18 +301,50 @@ private:
 };
 
 inline bool HI_UNUSED spinlock_try_lock(Spinlock& lock) {
-  return hi_atomic_cas_bool(&lock, (int32_t)0, (int32_t)1); }
+  return hi_atomic_load(&lock, HI_ATOMIC_RELAXED) == 0 &&
+         hi_atomic_cas_bool_explicit(&lock, (int32_t)0, (int32_t)1, HI_ATOMIC_ACQUIRE); }
 inline void HI_UNUSED spinlock_lock(Spinlock& lock) {
-  while (!spinlock_try_lock(lock)); }
+  if (!hi_atomic_cas_bool_explicit(&lock, (int32_t)0, (int32_t)1, HI_ATOMIC_ACQUIRE)) {
+    _spinlock_lock_contended(lock);
+  } }
 inline void HI_UNUSED spinlock_unlock(Spinlock& lock) {
-  lock = 0; }
-
-inline bool HI_UNUSED spinlock_try_lock(Spinlock* lock) {
-  return hi_atomic_cas_bool(lock, (int32_t)0, (int32_t)1); }
-inline void HI_UNUSED spinlock_lock(Spinlock* lock) {
-  while (!spinlock_try_lock(lock)); }
-inline void HI_UNUSED spinlock_unlock(Spinlock* lock) {
-  *lock = 0; }
+  if (hi_atomic_exchange(&lock, (int32_t)0, HI_ATOMIC_RELEASE) == 2) {
+    _spinlock_wake(lock);
+  } }
+
+inline bool HI_UNUSED spinlock_try_lock(Spinlock* lock) { return spinlock_try_lock(*lock); }
+inline void HI_UNUSED spinlock_lock(Spinlock* lock) { spinlock_lock(*lock); }
+inline void HI_UNUSED spinlock_unlock(Spinlock* lock) { spinlock_unlock(*lock); }
+
+struct TicketLock {
+  volatile uint32_t next = 0;    // ticket of the next locker
+  volatile uint32_t serving = 0; // ticket of the lock holder
+};
+
+void _ticketlock_wait(TicketLock& lock, uint32_t ticket);
+
+inline void HI_UNUSED ticketlock_lock(TicketLock& lock) {
+  uint32_t ticket = hi_atomic_add_fetch_explicit(&lock.next, 1u, HI_ATOMIC_RELAXED) - 1;
+  if (hi_atomic_load(&lock.serving, HI_ATOMIC_ACQUIRE) != ticket) {
+    _ticketlock_wait(lock, ticket);
+  } }
+inline void HI_UNUSED ticketlock_unlock(TicketLock& lock) {
+  // Only the holder writes `serving`
+  hi_atomic_store(&lock.serving, lock.serving + 1, HI_ATOMIC_RELEASE); }
+
+struct ScopedTicketLock {
+  ScopedTicketLock(TicketLock& lock) : _lock(lock) { ticketlock_lock(_lock); }
+  ~ScopedTicketLock() { ticketlock_unlock(_lock); }
+private:
+  TicketLock& _lock;
+};
+
+// Process-wide lock contention counters
+struct spinlock_counters {
+  uint64_t contended; // acquisitions that had to wait
+  uint64_t parked;    // times a Spinlock locker went to sleep
+};
+spinlock_counters spinlock_stats();
 
 } // namespace
 #endif // __cplusplus
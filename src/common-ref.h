@@ -15,6 +15,32 @@ struct ref_counted {
 #endif
 };
 
+// Reference-counted objects which are only ever referenced from one thread at a time, e.g. from a
+// single queue, and can do with non-atomic reference counting. Used with HI_LOCAL_REF_MIXIN.
+struct local_ref_counted {
+  uint32_t __refcount = 1;
+#if HI_DEBUG
+  std::function<void()> __debug_on_dealloc;
+#endif
+};
+
+// Taking a reference needs no ordering, as whoever copies a reference already holds one. Dropping
+// one releases the holder's writes to the object, and the last one acquires all of them before the
+// object is deallocated. Returns true if the last reference was dropped.
+inline static void ref_retain(ref_counted* p) {
+  hi_atomic_add_fetch_explicit(&p->__refcount, 1, HI_ATOMIC_RELAXED);
+}
+inline static bool ref_release(ref_counted* p) {
+  if (hi_atomic_sub_fetch_explicit(&p->__refcount, 1, HI_ATOMIC_RELEASE) != 0) {
+    return false;
+  }
+  hi_atomic_fence(HI_ATOMIC_ACQUIRE);
+  return true;
+}
+
+inline static void ref_retain(local_ref_counted* p) { ++p->__refcount; }
+inline static bool ref_release(local_ref_counted* p) { return --p->__refcount == 0; }
+
 // Example:
 // lolcat.h:
 //   struct lolcat { HI_REF_MIXIN(lolcat)
@@ -39,19 +65,26 @@ struct ref_counted {
 //   }
 //
 // Must implement `static void dealloc(S* p)`.
-// 
-#define HI_REF_MIXIN(T) \
+//
+// HI_LOCAL_REF_MIXIN is the same except that S derives from local_ref_counted, and that its
+// references must not be copied or dropped concurrently from different threads. That includes
+// references captured by callbacks passed to the library, which may copy and destroy callbacks on
+// other threads.
+//
+#define HI_REF_MIXIN(T) _HI_REF_MIXIN(T, ::hi::ref_counted)
+#define HI_LOCAL_REF_MIXIN(T) _HI_REF_MIXIN(T, ::hi::local_ref_counted)
+
+#define _HI_REF_MIXIN(T, BASE) \
 public: \
   struct S; friend S; S* self = nullptr; \
   \
   static void dealloc(S* p); \
   static void __retain(S* p) { \
-    if (p != nullptr) { hi_atomic_add32((int32_t*)&((::hi::ref_counted*)p)->__refcount, 1); } \
+    if (p != nullptr) { ::hi::ref_retain((BASE*)p); } \
   } \
   static void __release(S* p) { \
-    if (p != nullptr \
-        && (hi_atomic_sub_fetch(&((::hi::ref_counted*)p)->__refcount, 1) == 0)) { \
-      _HI_DEBUG_REF_DEALLOC(p) \
+    if (p != nullptr && ::hi::ref_release((BASE*)p)) { \
+      _HI_DEBUG_REF_DEALLOC(BASE, p) \
       dealloc(p); \
     } \
   } \
@@ -130,13 +163,13 @@ public: \
     ref_counted* self = (ref_counted*)obj.self;
     self->__debug_on_dealloc = [=]{ b(self); };
   }
-  #define _HI_DEBUG_REF_DEALLOC(p) do { \
-    if ((bool)((::hi::ref_counted*)(p))->__debug_on_dealloc) { \
-      ((::hi::ref_counted*)(p))->__debug_on_dealloc(); \
+  #define _HI_DEBUG_REF_DEALLOC(BASE, p) do { \
+    if ((bool)((BASE*)(p))->__debug_on_dealloc) { \
+      ((BASE*)(p))->__debug_on_dealloc(); \
     } \
   } while(0);
 #else
-  #define _HI_DEBUG_REF_DEALLOC(p)
+  #define _HI_DEBUG_REF_DEALLOC(BASE, p)
 #endif
 
 // template <typename T> using ref = ::std::shared_ptr<T>;
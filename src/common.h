@@ -105,6 +105,9 @@
   #define HI_NORETURN 
 #endif
 
+// Thread-local storage for POD types
+#define HI_THREAD_LOCAL __thread
+
 #define HI_NOT_IMPLEMENTED \
   HI_FATAL("NOT IMPLEMENTED in %s", __PRETTY_FUNCTION__)
 
@@ -1,6 +1,19 @@
 #include <hi/hi.h>
 #include <uv.h>
 #include <queue>
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#if HI_TARGET_OS_LINUX
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#elif HI_TARGET_OS_DARWIN
+#include <pthread/qos.h>
+#endif
 
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 #include <openssl/ssl.h>
@@ -32,18 +45,304 @@ static error loop_error(uv_loop_t* loop) {
   return error(std::string(uv_err_name(e)) + ": " + uv_strerror(e), e.code);
 }
 
+static error timeout_error(const char* operation) {
+  return error(std::string(operation) + " timed out", UV_ETIMEDOUT);
+}
+
 // ------------------------------------------------------------------------------------------------
 //                                            async
 // ------------------------------------------------------------------------------------------------
 #pragma mark - async
 
+static const size_t qos_count = static_cast<size_t>(qos::interactive) + 1;
+
+#if HI_TARGET_OS_LINUX
+// Nice value of the process, which those of QoS classes are relative to. Read by the thread
+// spawner before it creates any thread.
+static int process_nice = 0;
+#endif
+
+// Give the calling thread the scheduling priority of `c`. Threads of the normal class keep the
+// priority of the process. Best effort: raising the priority above that of the process needs
+// privileges, and failures are ignored.
+static void set_thread_qos(qos c) {
+  if (c == qos::normal) {
+    return;
+  }
+  #if HI_TARGET_OS_LINUX
+  static const int policies[qos_count] = { SCHED_IDLE, SCHED_BATCH, SCHED_OTHER, SCHED_OTHER };
+  static const int nice_offsets[qos_count] = { 19, 10, 0, -10 };
+  struct sched_param param = { 0 };
+  pthread_setschedparam(pthread_self(), policies[static_cast<size_t>(c)], &param);
+  // Nice values are per thread on Linux
+  int nice = HI_MIN(HI_MAX(process_nice + nice_offsets[static_cast<size_t>(c)], -20), 19);
+  setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), nice);
+  #elif HI_TARGET_OS_DARWIN
+  static const qos_class_t classes[qos_count] = {
+    QOS_CLASS_BACKGROUND, QOS_CLASS_UTILITY, QOS_CLASS_DEFAULT, QOS_CLASS_USER_INTERACTIVE };
+  pthread_set_qos_class_self_np(classes[static_cast<size_t>(c)], 0);
+  #endif
+}
+
+
+// Threads start out with the scheduling priority of the thread that creates them, and a thread
+// that has given up priority can't take it back. Queue and pool threads are therefore all created
+// by a spawner thread which keeps the priority of the process. The spawner is created by the
+// first thread to start a queue or pool, before any thread has been given a QoS class.
+struct thread_spawner {
+  struct request {
+    fun<void()> fn;
+    uv_thread_t thread;
+    int         status;
+    uv_sem_t    done;
+  };
+
+  uv_mutex_t           mutex;
+  uv_cond_t            cond;
+  std::deque<request*> requests;
+  uv_thread_t          thread;
+
+  thread_spawner() {
+    uv_mutex_init(&mutex);
+    uv_cond_init(&cond);
+    int status = uv_thread_create(&thread, [](void* p) {
+      static_cast<thread_spawner*>(p)->main();
+    }, this);
+    assert(status == 0);
+  }
+
+  void main() {
+    #if HI_TARGET_OS_LINUX
+    process_nice = getpriority(PRIO_PROCESS, 0);
+    #endif
+    while (true) {
+      uv_mutex_lock(&mutex);
+      while (requests.empty()) {
+        uv_cond_wait(&cond, &mutex);
+      }
+      request* req = requests.front();
+      requests.pop_front();
+      uv_mutex_unlock(&mutex);
+      fun<void()>* fn = new fun<void()>(std::move(req->fn));
+      req->status = uv_thread_create(&req->thread, [](void* p) {
+        fun<void()>* fn = static_cast<fun<void()>*>(p);
+        pthread_detach(pthread_self()); // never joined
+        (*fn)();
+        delete fn;
+      }, fn);
+      if (req->status != 0) {
+        delete fn;
+      }
+      uv_sem_post(&req->done);
+    }
+  }
+
+  // Start a thread running `fn`. Returns once the thread has been created.
+  int spawn(uv_thread_t* thread, fun<void()>&& fn) {
+    request req;
+    req.fn = std::move(fn);
+    uv_sem_init(&req.done, 0);
+    uv_mutex_lock(&mutex);
+    requests.push_back(&req);
+    uv_cond_signal(&cond);
+    uv_mutex_unlock(&mutex);
+    uv_sem_wait(&req.done);
+    uv_sem_destroy(&req.done);
+    *thread = req.thread;
+    return req.status;
+  }
+};
+
+static int spawn_thread(uv_thread_t* thread, fun<void()> fn) {
+  // Lives for the remainder of the process
+  static thread_spawner* spawner = new thread_spawner;
+  return spawner->spawn(thread, std::move(fn));
+}
+
+
+#if !defined(__STDC_NO_THREADS__)
+
+// A fixed set of worker threads where each worker owns a deque of tasks per QoS class. Workers take
+// tasks of the highest class there is first. Within a class, a worker pops tasks from the back of
+// its own deque (most recently pushed first, which is good for cache locality) and when its deque
+// is empty it steals from the front of other workers' deques. Idle workers park on a condition
+// variable until new tasks arrive. The worker threads run with the priority of `thread_qos`.
+struct worker_pool {
+  struct worker {
+    worker_pool*            pool;
+    size_t                  index;
+    Spinlock                lock = SB_SPINLOCK_INIT;
+    std::deque<fun<void()>> tasks[qos_count];
+  };
+
+  worker_pool(size_t n, qos c = qos::normal)
+      : nworkers(n), workers(new worker[n]), thread_qos(c) {
+    for (size_t i = 0; i != nworkers; ++i) {
+      workers[i].pool = this;
+      workers[i].index = i;
+    }
+  }
+
+  ~worker_pool() { delete[] workers; }
+
+  // Start the worker threads. Tasks submitted before this call are held until then.
+  void start() {
+    nrunning = nworkers;
+    for (size_t i = 0; i != nworkers; ++i) {
+      worker* w = &workers[i];
+      uv_thread_t thread;
+      int status = spawn_thread(&thread, [w]{
+        set_thread_qos(w->pool->thread_qos);
+        w->pool->main(*w);
+      });
+      assert(status == 0);
+    }
+  }
+
+  // Let the workers finish all tasks and then exit. The pool deletes itself when the last worker
+  // exits, or immediately if it was never started.
+  void shutdown() {
+    if (nrunning == 0) {
+      delete this;
+      return;
+    }
+    std::lock_guard<std::mutex> lock(park_mutex);
+    stopping = true;
+    park_cond.notify_all();
+  }
+
+  bool is_current() const {
+    return _current_worker != nullptr && _current_worker->pool == this;
+  }
+
+  // Enqueue a task. Never blocks on the task being run.
+  void submit(fun<void()>&& f, qos c = qos::normal) {
+    size_t ci = static_cast<size_t>(c);
+    worker* w = _current_worker;
+    if (w == nullptr || w->pool != this) {
+      // Not called from one of our workers. Distribute round-robin.
+      w = &workers[hi_atomic_add_fetch(&next_worker, 1) % nworkers];
+    }
+    { ScopedSpinlock lock(w->lock); w->tasks[ci].emplace_back(std::move(f)); }
+    // The class count goes up first, so a worker that sees `ntasks` also sees which class to take
+    hi_atomic_add_fetch(&nqueued[ci], 1);
+    hi_atomic_add_fetch(&ntasks, 1);
+    // Pairs with a parking worker counting itself in `nparked` and then checking `ntasks`. With
+    // sequentially consistent operations on both sides, one side sees what the other did.
+    if (hi_atomic_load(&nparked, HI_ATOMIC_SEQ_CST) != 0) {
+      std::lock_guard<std::mutex> lock(park_mutex);
+      park_cond.notify_one();
+    }
+  }
+
+  bool pop_local(worker& w, size_t ci, fun<void()>& f) {
+    ScopedSpinlock lock(w.lock);
+    std::deque<fun<void()>>& tasks = w.tasks[ci];
+    if (tasks.empty()) { return false; }
+    f = std::move(tasks.back());
+    tasks.pop_back();
+    return true;
+  }
+
+  bool steal(worker& thief, size_t ci, fun<void()>& f) {
+    for (size_t i = 1; i != nworkers; ++i) {
+      worker& victim = workers[(thief.index + i) % nworkers];
+      ScopedSpinlock lock(victim.lock);
+      std::deque<fun<void()>>& tasks = victim.tasks[ci];
+      if (!tasks.empty()) {
+        f = std::move(tasks.front());
+        tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Take a task of the highest class that has any queued
+  bool take(worker& w, fun<void()>& f) {
+    for (size_t ci = qos_count; ci-- != 0; ) {
+      // Negative while a task is taken before its submitter has counted it
+      if (hi_atomic_load(&nqueued[ci], HI_ATOMIC_RELAXED) <= 0) {
+        continue;
+      }
+      if (pop_local(w, ci, f) || steal(w, ci, f)) {
+        hi_atomic_sub_fetch(&nqueued[ci], 1);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void main(worker& w) {
+    _current_worker = &w;
+    fun<void()> f;
+    while (true) {
+      if (take(w, f)) {
+        hi_atomic_sub_fetch(&ntasks, 1);
+        f();
+        f = nullptr; // release anything captured by the task before we park
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(park_mutex);
+      if (stopping && hi_atomic_load(&ntasks, HI_ATOMIC_SEQ_CST) == 0) {
+        break;
+      }
+      hi_atomic_add_fetch(&nparked, 1);
+      park_cond.wait(lock, [this]{
+        return hi_atomic_load(&ntasks, HI_ATOMIC_SEQ_CST) != 0 || stopping;
+      });
+      hi_atomic_sub_fetch(&nparked, 1);
+    }
+    _current_worker = nullptr;
+    if (hi_atomic_sub_fetch(&nrunning, 1) == 0) {
+      delete this;
+    }
+  }
+
+  size_t                  nworkers;
+  worker*                 workers;
+  volatile size_t         next_worker = 0;
+  volatile long           ntasks = 0;   // number of tasks in all deques
+  volatile long           nqueued[qos_count] = {};  // number of tasks per class
+  volatile long           nparked = 0;  // number of workers waiting for tasks
+  volatile long           nrunning = 0; // number of live worker threads
+  bool                    stopping = false;
+  qos                     thread_qos;
+  std::mutex              park_mutex;
+  std::condition_variable park_cond;
+
+  static HI_THREAD_LOCAL worker* _current_worker;
+};
+
+HI_THREAD_LOCAL worker_pool::worker* worker_pool::_current_worker = nullptr;
+
+
+// The pool for tasks of QoS class `c`. Pools are started on first use and live for the remainder
+// of the process.
+static worker_pool& async_pool(qos c) {
+  static worker_pool* pools[qos_count];
+  static std::once_flag flags[qos_count]; // unlike hi::once, makes concurrent callers wait
+  size_t ci = static_cast<size_t>(c);
+  std::call_once(flags[ci], [=]{
+    pools[ci] = new worker_pool(HI_MAX(std::thread::hardware_concurrency(), 1u), c);
+    pools[ci]->start();
+  });
+  return *pools[ci];
+}
+
+#endif // !defined(__STDC_NO_THREADS__)
+
 
 void async(fun<void()> f) {
-  // TODO: thread pool with an unlocked limit of `unsigned int std::thread::hardware_concurrency()`
+  async(qos::normal, std::move(f));
+}
+
+
+void async(qos c, fun<void()> f) {
   #if !defined(__STDC_NO_THREADS__)
-  std::async(std::launch::async, f);
+  async_pool(c).submit(std::move(f));
   #else
-  queue("async").async(f).resume(); // sloooowwwww
+  queue("async", c).async(f).resume(); // sloooowwwww
   #endif
 }
 
@@ -64,6 +363,70 @@ bool sleep(double seconds) {
 }
 
 
+// Contended Spinlock and TicketLock paths. See common-atomic.h.
+
+static volatile uint64_t _spinlock_contended = 0;
+static volatile uint64_t _spinlock_parked = 0;
+
+// Spinning waiters pause for 1, 2, 4 ... spinlock_max_backoff iterations between checks of the
+// lock, a few microseconds in total, before they go to sleep.
+static const uint32_t spinlock_max_backoff = 256;
+static const uint32_t ticketlock_spin_rounds = 8;
+
+void _spinlock_lock_contended(Spinlock& lock) {
+  hi_atomic_add_fetch_explicit(&_spinlock_contended, (uint64_t)1, HI_ATOMIC_RELAXED);
+  for (uint32_t backoff = 1; backoff <= spinlock_max_backoff; backoff *= 2) {
+    for (uint32_t i = 0; i != backoff; ++i) {
+      hi_cpu_relax();
+    }
+    // Only reads the lock until it's free, so waiters don't keep taking its cache line
+    if (spinlock_try_lock(lock)) {
+      return;
+    }
+  }
+  // Mark the lock as contended, which makes unlock() wake a sleeper. Whoever takes the lock after
+  // sleeping keeps the mark, as it can't know whether there are other sleepers.
+  hi_atomic_add_fetch_explicit(&_spinlock_parked, (uint64_t)1, HI_ATOMIC_RELAXED);
+  while (hi_atomic_exchange(&lock, (int32_t)2, HI_ATOMIC_ACQUIRE) != 0) {
+    #if HI_TARGET_OS_LINUX
+    syscall(SYS_futex, (int32_t*)&lock, FUTEX_WAIT_PRIVATE, 2, nullptr, nullptr, 0);
+    #else
+    sched_yield();
+    #endif
+  }
+}
+
+void _spinlock_wake(Spinlock& lock) {
+  #if HI_TARGET_OS_LINUX
+  syscall(SYS_futex, (int32_t*)&lock, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+  #endif
+}
+
+void _ticketlock_wait(TicketLock& lock, uint32_t ticket) {
+  hi_atomic_add_fetch_explicit(&_spinlock_contended, (uint64_t)1, HI_ATOMIC_RELAXED);
+  for (uint32_t round = 0;; ++round) {
+    uint32_t serving = hi_atomic_load(&lock.serving, HI_ATOMIC_ACQUIRE);
+    if (serving == ticket) {
+      return;
+    }
+    if (round < ticketlock_spin_rounds) {
+      // Roughly as long as the lockers ahead of us will take
+      uint32_t n = HI_MIN(ticket - serving, (uint32_t)8) * 16;
+      for (uint32_t i = 0; i != n; ++i) {
+        hi_cpu_relax();
+      }
+    } else {
+      sched_yield();
+    }
+  }
+}
+
+spinlock_counters spinlock_stats() {
+  return spinlock_counters{ hi_atomic_load(&_spinlock_contended, HI_ATOMIC_RELAXED),
+                            hi_atomic_load(&_spinlock_parked, HI_ATOMIC_RELAXED) };
+}
+
+
 // Hint to reschedule the execution of queues. Yield some time for other queues.
 // void yield() {
 // #if !defined(__STDC_NO_THREADS__)
@@ -83,83 +446,554 @@ bool sleep(double seconds) {
 static queue _main_queue(nullptr);
 static unsigned long _main_thread_id = 0;
 
+// Free lists of fixed-size records like blocks and I/O jobs, recycling memory without going through
+// the global allocator. Each queue owns a slab which is only ever used from the queue's thread.
+struct slab {
+  static const size_t granularity = 32;
+  static const size_t max_size = 512;  // larger records always go to malloc
+  static const size_t nclasses = max_size / granularity;
+  static const uint32_t max_free_per_class = 256;
+
+  struct free_node { free_node* next; };
+
+  free_node* free_lists[nclasses] = {nullptr};
+  uint32_t   free_counts[nclasses] = {0};
+  uint64_t   hits = 0;
+  uint64_t   misses = 0;
+
+  static size_t class_of(size_t z) { return (z - 1) / granularity; }
+
+  void* alloc(size_t z) {
+    size_t c = class_of(z);
+    free_node* n = free_lists[c];
+    if (n != nullptr) {
+      free_lists[c] = n->next;
+      --free_counts[c];
+      ++hits;
+      return (void*)n;
+    }
+    ++misses;
+    return ::malloc((c + 1) * granularity);
+  }
+
+  void free(void* p, size_t z) {
+    size_t c = class_of(z);
+    if (free_counts[c] == max_free_per_class) {
+      ::free(p);
+    } else {
+      free_node* n = (free_node*)p;
+      n->next = free_lists[c];
+      free_lists[c] = n;
+      ++free_counts[c];
+    }
+  }
+
+  void purge() {
+    for (size_t c = 0; c != nclasses; ++c) {
+      while (free_lists[c] != nullptr) {
+        free_node* n = free_lists[c];
+        free_lists[c] = n->next;
+        ::free((void*)n);
+      }
+      free_counts[c] = 0;
+    }
+  }
+};
+
+// Free lists of I/O buffers in power-of-two size classes. Each class has room for a data header in
+// front of its power-of-two bytes, since most buffers are allocated together with one by
+// data_alloc. Like the slab, each queue owns a buffer pool which is only used from the queue's
+// thread. The total size of buffers held in free lists is
+// capped at `byte_limit`, which can be changed from any thread.
+struct buffer_pool {
+  static const size_t min_class_shift = 10; // 1 kB
+  static const size_t max_class_shift = 16; // 64 kB, the most libuv asks for per read
+  static const size_t nclasses = max_class_shift - min_class_shift + 1;
+  static const size_t default_byte_limit = 1024 * 1024;
+  static const size_t header_size = sizeof(data::S);
+
+  struct free_node { free_node* next; };
+
+  free_node* free_lists[nclasses] = {nullptr};
+  size_t     byte_size = 0;
+  volatile size_t byte_limit = default_byte_limit;
+  uint64_t   hits = 0;
+  uint64_t   misses = 0;
+
+  // Smallest size class that fits `z` bytes, or nclasses if `z` is too large
+  static size_t class_of(size_t z) {
+    size_t c = 0;
+    while (c != nclasses && class_size(c) < z) { ++c; }
+    return c;
+  }
+  static size_t class_size(size_t c) { return (size_t(1) << (c + min_class_shift)) + header_size; }
+
+  // Returns a buffer of at least `z` bytes and sets `z` to its actual capacity
+  char* alloc(size_t& z) {
+    size_t c = class_of(z);
+    if (c == nclasses) {
+      ++misses;
+      return (char*)::malloc(z);
+    }
+    z = class_size(c);
+    free_node* n = free_lists[c];
+    if (n != nullptr) {
+      free_lists[c] = n->next;
+      byte_size -= z;
+      ++hits;
+      return (char*)n;
+    }
+    ++misses;
+    return (char*)::malloc(z);
+  }
+
+  void free(char* p, size_t capacity) {
+    size_t c = class_of(capacity);
+    if (c == nclasses || class_size(c) != capacity ||
+        byte_size + capacity > hi_atomic_load(&byte_limit, HI_ATOMIC_RELAXED)) {
+      ::free((void*)p);
+    } else {
+      free_node* n = (free_node*)p;
+      n->next = free_lists[c];
+      free_lists[c] = n;
+      byte_size += capacity;
+    }
+  }
+
+  void purge() {
+    for (size_t c = 0; c != nclasses; ++c) {
+      while (free_lists[c] != nullptr) {
+        free_node* n = free_lists[c];
+        free_lists[c] = n->next;
+        ::free((void*)n);
+      }
+    }
+    byte_size = 0;
+  }
+};
+
+template <typename T> static void record_delete(T* p);
+
+// A block waiting to be run by a queue. Blocks are linked into a queue's pending list by producers
+// and unlinked in batch by the queue's runloop.
+struct queue_block {
+  queue_block* next;
+  fun<void()>  fn;
+  queue_block(fun<void()>&& f) : next(nullptr), fn(std::move(f)) {}
+};
+
+// A function scheduled on a queue by queue::after or queue::every. `due` is in uv_hrtime
+// nanoseconds and `interval` is 0 unless the timer repeats.
+struct timer::S : ref_counted {
+  static const size_t npos = SIZE_MAX;
+
+  queue         q;
+  fun<void()>   fn;
+  uint64_t      due;
+  uint64_t      interval;
+  uint64_t      seq = 0;      // orders timers which are due at the same time
+  size_t        index = npos; // position in the queue's timer heap, or npos if not in it
+  volatile bool cancelled = false;
+};
+
+void timer::dealloc(S* self) {
+  delete self;
+}
+
+// Binary min-heap of the timers of a queue, earliest due first. Each timer in the heap holds a
+// reference which is taken over by push and handed back by remove. Only used from the queue's
+// thread.
+struct timer_heap {
+  std::vector<timer::S*> v;
+  uint64_t               next_seq = 0;
+
+  static bool before(const timer::S* a, const timer::S* b) {
+    return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+  }
+
+  bool empty() const { return v.empty(); }
+  timer::S* top() const { return v.front(); }
+
+  void push(timer::S* t) {
+    t->seq = next_seq++;
+    v.push_back(t);
+    sift_up(v.size() - 1);
+  }
+
+  void remove(timer::S* t) {
+    size_t i = t->index;
+    timer::S* last = v.back();
+    v.pop_back();
+    t->index = timer::S::npos;
+    if (last != t) {
+      place(i, last);
+      sift_up(i);
+      sift_down(last->index);
+    }
+  }
+
+  void place(size_t i, timer::S* t) {
+    v[i] = t;
+    t->index = i;
+  }
+
+  void sift_up(size_t i) {
+    timer::S* t = v[i];
+    while (i != 0 && before(t, v[(i - 1) / 2])) {
+      place(i, v[(i - 1) / 2]);
+      i = (i - 1) / 2;
+    }
+    place(i, t);
+  }
+
+  void sift_down(size_t i) {
+    timer::S* t = v[i];
+    for (;;) {
+      size_t c = i * 2 + 1;
+      if (c >= v.size()) {
+        break;
+      }
+      if (c + 1 < v.size() && before(v[c + 1], v[c])) {
+        ++c;
+      }
+      if (!before(v[c], t)) {
+        break;
+      }
+      place(i, v[c]);
+      i = c;
+    }
+    place(i, t);
+  }
+};
+
+// Number of times an idle runloop checks for new blocks before it goes to sleep. With a single
+// CPU the thread that would enqueue a block can't run while we spin, so we don't.
+static int queue_spin_rounds() {
+  static const int n = (std::thread::hardware_concurrency() > 1) ? 100 : 0;
+  return n;
+}
+
 struct queue::S : ref_counted {
-  void wake_up_from_idle() {
+  // Wakes up the runloop if it's sleeping on idle_sem and returns true. Returns false if the
+  // runloop isn't idle.
+  bool wake_up_from_idle() {
     // printf("[queue::S::wake_up_from_idle %lu]\n", thread_id);
-    if (is_idle && hi_atomic_cas_bool(&is_idle, true, false)) {
+    // Producers publish a block and then check the idle flag, while the runloop sets the flag and
+    // then checks for blocks. One side must see what the other did, which takes sequentially
+    // consistent operations on both sides. A sequentially consistent load is a plain load on x86
+    // and a load-acquire on ARMv8, so the common case where the queue isn't idle needs no fence.
+    if (hi_atomic_load(&is_idle, HI_ATOMIC_SEQ_CST) && hi_atomic_cas_bool(&is_idle, true, false)) {
       // printf("[queue::S::wake_up_from_idle]\n");
       uv_sem_post(&idle_sem);
+      return true;
+    }
+    return false;
+  }
+
+  // Push a block onto the pending list. Safe to call from any thread.
+  void enqueue(queue_block* b) {
+    queue_block* head;
+    do {
+      head = pending_blocks;
+      b->next = head;
+    } while (!hi_atomic_cas_bool(&pending_blocks, head, b));
+    // A runloop sleeps either on idle_sem, when its loop has nothing else to wait for, or in the
+    // loop's poller. Only one of them needs waking. uv_async_send is a no-op while a previous send
+    // is still unprocessed.
+    if (!wake_up_from_idle()) {
+      uv_async_send(&async_handle);
+    }
+  }
+
+  bool has_pending_blocks() const {
+    return hi_atomic_load(&pending_blocks, HI_ATOMIC_SEQ_CST) != nullptr;
+  }
+
+  // Run all pending blocks. Must be called on the queue's thread. Returns false if there was
+  // nothing to run.
+  bool drain_blocks() {
+    queue_block* b = (queue_block*)hi_atomic_swap(&pending_blocks, nullptr);
+    if (b == nullptr) {
+      return false;
+    }
+    // The pending list is LIFO. Reverse it so blocks run in the order they were enqueued.
+    queue_block* fifo = nullptr;
+    while (b != nullptr) {
+      queue_block* next = b->next;
+      b->next = fifo;
+      fifo = b;
+      b = next;
+    }
+    while (fifo != nullptr) {
+      b = fifo;
+      fifo = b->next;
+      b->fn();
+      record_delete(b);
+    }
+    return true;
+  }
+
+  // Blocks often arrive in quick succession, so check a few times before going to sleep. Returns
+  // true if a block arrived.
+  bool spin_for_blocks() const {
+    for (int i = 0, n = queue_spin_rounds(); i != n; ++i) {
+      if (has_pending_blocks()) {
+        return true;
+      }
+      hi_cpu_relax();
+    }
+    return has_pending_blocks();
+  }
+
+  // Run blocks and loop events once. Returns true if there's more work to be done.
+  bool run_once(bool wait) {
+    drain_blocks();
+    // The loop only blocks when it has handles to wait for and none of them is ready, so that's
+    // the only time spinning can save a wakeup
+    bool block = wait && !has_pending_blocks() && uv_backend_timeout(loop) != 0 &&
+                 !spin_for_blocks();
+    int r = uv_run(loop, block ? UV_RUN_ONCE : UV_RUN_NOWAIT);
+    return r != 0 || has_pending_blocks();
+  }
+
+  // Timers are kept in a heap and a single uv timer is armed for the earliest one. Must be called
+  // on the queue's thread.
+  void add_timer(timer::S* t) {
+    timers.push(t);
+    if (t->index == 0) {
+      arm_timer_handle();
+    }
+  }
+
+  void remove_timer(timer::S* t) {
+    bool was_first = t->index == 0;
+    timers.remove(t);
+    if (was_first) {
+      arm_timer_handle();
+    }
+  }
+
+  void arm_timer_handle() {
+    if (timers.empty()) {
+      uv_timer_stop(&timer_handle);
+      return;
+    }
+    uint64_t now = uv_hrtime();
+    uint64_t due = timers.top()->due;
+    uint64_t timeout = (due > now) ? (due - now + 999999) / 1000000 : 0; // ms, rounded up
+    uv_timer_start(&timer_handle, [](uv_timer_t* handle, int status) {
+      static_cast<queue::S*>(handle->data)->run_timers();
+    }, timeout, 0);
+  }
+
+  void run_timers() {
+    uint64_t now = uv_hrtime();
+    while (!timers.empty() && timers.top()->due <= now) {
+      timer::S* t = timers.top();
+      timers.remove(t);
+      if (!t->cancelled) {
+        t->fn();
+      }
+      if (t->interval != 0 && !t->cancelled) {
+        // Runs that were missed are skipped rather than made up for
+        t->due += t->interval;
+        if (t->due <= now) {
+          t->due = now + t->interval;
+        }
+        timers.push(t);
+      } else {
+        t->fn = nullptr;
+        timer::__release(t);
+      }
     }
+    arm_timer_handle();
   }
 
   // Called by queue::resume() and comprises the runloop of a queue
   void main() {
     // Note: Until we return from this function we are guaranteed to hold a reference to self.
     thread_id = uv_thread_self();
+    _current_queue = this;
     // printf("[queue::S::main %lu] enter\n", thread_id);
 
-    while (!stopped) {
-      while (uv_run(loop, UV_RUN_ONCE) != 0 && stopped == false) {
+    while (!is_stopped()) {
+      while (run_once(true) && !is_stopped()) {
         // There're more events to process
       }
       // No queued events
-      if (dealloc_after_runloop) {
+      if (hi_atomic_load(&dealloc_after_runloop, HI_ATOMIC_ACQUIRE)) {
         set_stopped(true);
-      } else if (hi_atomic_cas_bool(&is_idle, false, true)) {
-        uv_sem_wait(&idle_sem);
-        if (dealloc_after_runloop) {
-          set_stopped(true);
+      } else if (!spin_for_blocks() && hi_atomic_cas_bool(&is_idle, false, true)) {
+        // A block might have been enqueued after we last checked. In that case we take back the
+        // idle flag, unless a producer already took it, in which case its post must be consumed.
+        if (!has_pending_blocks() || !hi_atomic_cas_bool(&is_idle, true, false)) {
+          uv_sem_wait(&idle_sem);
         }
       }
     }
 
-    assert(stopped == true);
+    assert(is_stopped());
     uv_stop(loop);
+    _current_queue = nullptr;
     // printf("[queue::S::main %lu] exit\n", thread_id);
   }
 
-  void set_is_idle(bool b) {
-    hi_atomic_barrier();
-    is_idle = b;
-  }
-  void set_stopped(bool b) {
-    hi_atomic_barrier();
-    stopped = b;
-  }
+  // Flags shared with other threads. Stores release what was written before them to threads
+  // that load the flags.
+  bool is_stopped() const { return hi_atomic_load(&stopped, HI_ATOMIC_ACQUIRE); }
+  void set_stopped(bool b) { hi_atomic_store(&stopped, b, HI_ATOMIC_RELEASE); }
   void set_dealloc_after_runloop(bool b) {
-    hi_atomic_barrier();
-    dealloc_after_runloop = b;
+    hi_atomic_store(&dealloc_after_runloop, b, HI_ATOMIC_RELEASE);
   }
 
-  S(const std::string& l): label(l), loop(uv_loop_new()) {}
+  S(const std::string& l, qos c = qos::normal): label(l), qos_class(c), loop(uv_loop_new()) {
+    async_handle.data = this;
+    int r = uv_async_init(loop, &async_handle, [](uv_async_t* handle, int status) {
+      static_cast<queue::S*>(handle->data)->drain_blocks();
+    });
+    assert(r == 0);
+    // The async handle lives as long as the queue and should not by itself keep the loop alive
+    uv_unref((uv_handle_t*)&async_handle);
+    timer_handle.data = this;
+    uv_timer_init(loop, &timer_handle);
+  }
 
   std::string   label;
-  uv_thread_t   thread;
+  qos           qos_class;  // of the queue's thread
+  uv_thread_t   thread = 0;
   unsigned long thread_id = 0;
   uv_loop_t*    loop;
-  uv_idle_t     loop_idler;
   uv_sem_t      idle_sem;
+  uv_async_t    async_handle;  // wakes up the loop when blocks are enqueued
+  uv_timer_t    timer_handle;  // due when the first timer in `timers` is
+  timer_heap    timers;
+  queue_block* volatile pending_blocks = nullptr;
   volatile bool is_idle = false;
   volatile bool stopped = true;
   volatile bool dealloc_after_runloop = false;
+  volatile bool dealloc_wakeup_sent = false;  // set after the wakeup for dealloc_after_runloop
+  slab          records;
+  buffer_pool   buffers;
+
+  static HI_THREAD_LOCAL S* _current_queue;
 };
 
+HI_THREAD_LOCAL queue::S* queue::S::_current_queue = nullptr;
+
+
+// Returns the queue which is running on the calling thread, or nullptr if the calling thread isn't
+// running a queue.
+static queue::S* current_queue_s() {
+  queue::S* q = queue::S::_current_queue;
+  if (q == nullptr && uv_thread_self() == _main_thread_id) {
+    q = queue::S::_current_queue = main_queue().self;
+  }
+  return q;
+}
+
+
+// Allocate and free fixed-size records using the calling queue's slab. Memory can be freed on a
+// different queue than the one it was allocated on, or on a thread without a queue.
+static void* record_alloc(size_t z) {
+  if (z > slab::max_size) {
+    return ::malloc(z);
+  }
+  queue::S* q = current_queue_s();
+  if (q != nullptr) {
+    return q->records.alloc(z);
+  }
+  // Round up so that the memory can later be recycled by any slab
+  return ::malloc((slab::class_of(z) + 1) * slab::granularity);
+}
+
+static void record_free(void* p, size_t z) {
+  queue::S* q;
+  if (z <= slab::max_size && (q = current_queue_s()) != nullptr) {
+    q->records.free(p, z);
+  } else {
+    ::free(p);
+  }
+}
+
+// Allocate and free I/O buffers using the calling queue's buffer pool. `z` is set to the actual
+// capacity of the returned buffer.
+static char* buffer_alloc(size_t& z) {
+  queue::S* q = current_queue_s();
+  if (q != nullptr) {
+    return q->buffers.alloc(z);
+  }
+  return (char*)::malloc(z);
+}
+
+static void buffer_free(char* p, size_t capacity) {
+  queue::S* q = current_queue_s();
+  if (q != nullptr) {
+    q->buffers.free(p, capacity);
+  } else {
+    ::free((void*)p);
+  }
+}
+
+// Allocate a data object with its bytes following the header in the same allocation. The capacity
+// of the returned data is at least `z` bytes, rounded up to fill the buffer pool size class.
+static data::S* data_alloc(size_t z) {
+  size_t total = sizeof(data::S) + z;
+  char* p = buffer_alloc(total);
+  data::S* d = new (p) data::S;
+  d->bytes = p + sizeof(data::S);
+  d->size = 0;
+  d->capacity = total - sizeof(data::S);
+  d->parent = nullptr;
+  d->owns_bytes = false;
+  return d;
+}
+
+// Recover the data object from bytes returned by data_alloc
+static data::S* data_from_bytes(char* bytes) {
+  return (data::S*)(bytes - sizeof(data::S));
+}
+
+template <typename T, typename... Args> static T* record_new(Args&&... args) {
+  return new (record_alloc(sizeof(T))) T(std::forward<Args>(args)...);
+}
+
+template <typename T> static void record_delete(T* p) {
+  p->~T();
+  record_free((void*)p, sizeof(T));
+}
+
 
-queue::queue(const std::string& label) : queue(new S(label)) {
+queue::queue(const std::string& label, qos c) : queue(new S(label, c)) {
   int r = uv_sem_init(&self->idle_sem, 0);
   assert(r == 0);
 }
 
 
 void queue::dealloc(S* self) {
-  if (self->stopped) {
+  if (self->is_stopped()) {
     // printf("[queue::dealloc %lu] deleting\n", self->thread_id);
+    // Blocks that never got to run are discarded
+    queue_block* b = (queue_block*)hi_atomic_swap(&self->pending_blocks, nullptr);
+    while (b != nullptr) {
+      queue_block* next = b->next;
+      record_delete(b);
+      b = next;
+    }
+    self->records.purge();
+    self->buffers.purge();
+    // Timers hold a reference to their queue, so there are none left
+    assert(self->timers.empty());
+    uv_close((uv_handle_t*)&self->async_handle, nullptr);
+    uv_close((uv_handle_t*)&self->timer_handle, nullptr);
+    uv_run(self->loop, UV_RUN_NOWAIT); // finalize closing handles
     uv_loop_delete(self->loop);
     delete self;
   } else {
-    // the runloop is still alive and possibly in an idle state
+    // The runloop is still alive and possibly in an idle state. It might exit as soon as it sees
+    // the flag, so it waits for us to be done waking it up before it deletes the queue.
     self->set_dealloc_after_runloop(true);
     self->wake_up_from_idle();
+    hi_atomic_store(&self->dealloc_wakeup_sent, true, HI_ATOMIC_RELEASE);
   }
 }
 
@@ -175,6 +1009,10 @@ queue& main_queue() {
     s->thread_id = _main_thread_id;
     if (!hi_atomic_cas_bool(&_main_queue->self, nullptr, s)) {
       // someone else was faster than us
+      uv_close((uv_handle_t*)&s->async_handle, nullptr);
+      uv_close((uv_handle_t*)&s->timer_handle, nullptr);
+      uv_run(s->loop, UV_RUN_NOWAIT);
+      uv_loop_delete(s->loop);
       delete s;
     }
   }
@@ -193,71 +1031,198 @@ const std::string& queue::label() const {
 }
 
 
+queue::alloc_stats queue::slab_stats() const {
+  return alloc_stats{ self->records.hits, self->records.misses };
+}
+
+
+queue::alloc_stats queue::buffer_stats() const {
+  return alloc_stats{ self->buffers.hits, self->buffers.misses };
+}
+
+
+void queue::set_buffer_pool_limit(size_t bytes) const {
+  hi_atomic_store(&self->buffers.byte_limit, bytes, HI_ATOMIC_RELAXED);
+}
+
+
 queue& queue::resume() const {
   assert(self != _main_queue->self);
   assert(self->thread == 0);
-  int status = uv_thread_create(&self->thread, [](void* p) {
-    queue::S* self = static_cast<queue::S*>(p);
+  // Must be marked as running before the thread starts, or its runloop might exit immediately
+  self->set_stopped(false);
+  queue::S* self = this->self;
+  // The thread can't exit before we return, since it's only stopped once the queue is deallocated
+  int status = spawn_thread(&self->thread, [self]{
+    set_thread_qos(self->qos_class);
     self->main();
     self->thread = 0;
-    if (self->dealloc_after_runloop) {
+    if (hi_atomic_load(&self->dealloc_after_runloop, HI_ATOMIC_ACQUIRE)) {
+      while (!hi_atomic_load(&self->dealloc_wakeup_sent, HI_ATOMIC_ACQUIRE)) {
+        hi_cpu_relax();
+      }
       queue::dealloc(self);
     }
-  }, self);
+  });
   assert(status == 0); // todo: error
-  self->set_stopped(false);
   return const_cast<queue&>(*this);
 }
 
 
 queue& queue::async(fun<void()> b) const {
-  uv_async_t* handle = new uv_async_t;
-  handle->data = new fun<void()>(b);
-  int r = uv_async_init(self->loop, handle, [](uv_async_t* handle, int status) {
-    fun<void()>* b = (fun<void()>*)handle->data;
-    if (b != 0) {
-      // Since libuv says this could be called more than once
-      (*b)();
-      *b = []{}; // causes std::function to release its underlying ref
-      delete b;
-      handle->data = 0;
-      uv_close((uv_handle_t*)handle, [](uv_handle_t* handle) {
-        delete handle;
-      });
-      // uv_unref((uv_handle_t*)handle);
-      // delete handle;
-    }
-  });
-  assert(r == 0);
-  r = uv_async_send(handle);
-  assert(r == 0);
-  self->wake_up_from_idle();
+  self->enqueue(record_new<queue_block>(std::move(b)));
   return const_cast<queue&>(*this);
 }
 
-// queue queue::current() {
-//   return nullptr;
-// }
 
+static timer queue_schedule(const queue& q, double seconds, uint64_t interval, fun<void()>&& fn) {
+  timer t(new timer::S);
+  t.self->q = q;
+  t.self->fn = std::move(fn);
+  t.self->due = uv_hrtime() + static_cast<uint64_t>(HI_MAX(seconds, 0.0) * 1000000000.0);
+  t.self->interval = interval;
+  timer::__retain(t.self); // for the queue's timer heap
+  if (q.is_current()) {
+    q.self->add_timer(t.self);
+  } else {
+    timer::S* ts = t.self;
+    q.async([ts]{
+      if (ts->cancelled) {
+        ts->fn = nullptr;
+        timer::__release(ts);
+      } else {
+        ts->q.self->add_timer(ts);
+      }
+    });
+  }
+  return t;
+}
 
-int main_loop() {
-#if 0 // no auto-exit when empty
-  return main_queue().self->main();
+
+timer queue::after(double seconds, fun<void()> fn) const {
+  return queue_schedule(*this, seconds, 0, std::move(fn));
+}
+
+
+timer queue::every(double seconds, fun<void()> fn) const {
+  // At least a millisecond, as that's the resolution of the loop's timers
+  uint64_t interval = HI_MAX(static_cast<uint64_t>(seconds * 1000000000.0), (uint64_t)1000000);
+  return queue_schedule(*this, seconds, interval, std::move(fn));
+}
+
+
+void timer::cancel() const {
+  if (!hi_atomic_cas_bool(&self->cancelled, false, true)) {
+    return;
+  }
+  auto remove = [](timer::S* t) {
+    // Not in the heap while running, or before being added to it
+    if (t->index != timer::S::npos) {
+      t->q.self->remove_timer(t);
+      t->fn = nullptr;
+      timer::__release(t);
+    }
+  };
+  if (self->q.is_current()) {
+    remove(self);
+  } else {
+    timer t = *this;
+    self->q.async([t, remove]{ remove(t.self); });
+  }
+}
+
+// queue queue::current() {
+//   return nullptr;
+// }
+
+
+void sleep(double seconds, fun<void()> fn) {
+  queue::S* q = current_queue_s();
+  if (q == nullptr) {
+    // Not on a queue, so there's nowhere to resume but here
+    sleep(seconds);
+    fn();
+    return;
+  }
+  queue(q, /*addRef=*/true).after(seconds, std::move(fn));
+}
+
+
+int main_loop() {
+#if 0 // no auto-exit when empty
+  return main_queue().self->main();
 #else
-  uv_run(main_queue().self->loop, UV_RUN_DEFAULT);
+  queue::S* self = main_queue().self;
+  while (self->run_once(true)) {}
   return 0;
 #endif
 }
 
 bool main_next() {
-  return (uv_run(main_queue().self->loop, UV_RUN_ONCE) != 0);
+  return main_queue().self->run_once(true);
 }
 
 bool main_next_nowait() {
-  return (uv_run(main_queue().self->loop, UV_RUN_NOWAIT) != 0);
+  return main_queue().self->run_once(false);
+}
+
+
+// ------------------------------------------------------------------------------------------------
+//                                        concurrent_queue
+// ------------------------------------------------------------------------------------------------
+#pragma mark - concurrent_queue
+
+#if !defined(__STDC_NO_THREADS__)
+
+struct concurrent_queue::S : ref_counted {
+  std::string  label;
+  worker_pool* pool;
+  bool         resumed = false;
+  S(const std::string& l, size_t width, qos c) : label(l), pool(new worker_pool(width, c)) {}
+};
+
+
+concurrent_queue::concurrent_queue(const std::string& label, size_t width, qos c)
+    : concurrent_queue(new S(label,
+                             width != 0 ? width : HI_MAX(std::thread::hardware_concurrency(), 1u),
+                             c))
+{}
+
+
+void concurrent_queue::dealloc(S* self) {
+  // Workers finish any blocks still queued before exiting
+  self->pool->shutdown();
+  delete self;
+}
+
+
+concurrent_queue& concurrent_queue::resume() const {
+  assert(self->resumed == false);
+  self->resumed = true;
+  self->pool->start();
+  return const_cast<concurrent_queue&>(*this);
+}
+
+
+concurrent_queue& concurrent_queue::async(fun<void()> b) const {
+  self->pool->submit(std::move(b), self->pool->thread_qos);
+  return const_cast<concurrent_queue&>(*this);
+}
+
+
+concurrent_queue& concurrent_queue::async(qos c, fun<void()> b) const {
+  self->pool->submit(std::move(b), c);
+  return const_cast<concurrent_queue&>(*this);
 }
 
 
+bool concurrent_queue::is_current() const { return self->pool->is_current(); }
+const std::string& concurrent_queue::label() const { return self->label; }
+size_t concurrent_queue::width() const { return self->pool->nworkers; }
+
+#endif // !defined(__STDC_NO_THREADS__)
+
+
 // ------------------------------------------------------------------------------------------------
 //                                            semaphore
 // ------------------------------------------------------------------------------------------------
@@ -275,14 +1240,78 @@ bool main_next_nowait() {
 //   std::condition_variable cv;
 // };
 // #endif
+
+// Waiters are woken in the order they started waiting. A thread blocked in wait() is woken through
+// `sem`, while a continuation passed to wait(fn) is scheduled on the queue that waited.
 struct semaphore::S : ref_counted {
-  uv_sem_t sem;
+  struct waiter {
+    queue       q; // nullptr for a blocked thread
+    fun<void()> fn;
+  };
+
+  Spinlock            lock = SB_SPINLOCK_INIT;
+  unsigned int        value;
+  std::deque<waiter>  waiters;
+  uv_sem_t            sem;
+
+  S(unsigned int v) : value(v) { uv_sem_init(&sem, 0); }
+  ~S() { uv_sem_destroy(&sem); }
 };
 
-semaphore::semaphore(unsigned int value) : semaphore(new S) { uv_sem_init(&self->sem, value); }
-void semaphore::dealloc(S* self) { uv_sem_destroy(&self->sem); delete self; }
-void semaphore::signal() const { uv_sem_post(&self->sem); }
-void semaphore::wait() const { uv_sem_wait(&self->sem); }
+semaphore::semaphore(unsigned int value) : semaphore(new S(value)) {}
+void semaphore::dealloc(S* self) { delete self; }
+
+
+void semaphore::signal() const {
+  S::waiter w;
+  {
+    ScopedSpinlock lock(self->lock);
+    if (self->waiters.empty()) {
+      ++self->value;
+      return;
+    }
+    w = std::move(self->waiters.front());
+    self->waiters.pop_front();
+  }
+  if (w.q == nullptr) {
+    uv_sem_post(&self->sem);
+  } else {
+    w.q.async(std::move(w.fn));
+  }
+}
+
+
+void semaphore::wait() const {
+  {
+    ScopedSpinlock lock(self->lock);
+    if (self->value != 0) {
+      --self->value;
+      return;
+    }
+    self->waiters.push_back(S::waiter{nullptr, nullptr});
+  }
+  uv_sem_wait(&self->sem);
+}
+
+
+void semaphore::wait(fun<void()> fn) const {
+  queue::S* q = current_queue_s();
+  if (q == nullptr) {
+    // Not on a queue, so there's nowhere to resume but here
+    wait();
+    fn();
+    return;
+  }
+  {
+    ScopedSpinlock lock(self->lock);
+    if (self->value == 0) {
+      self->waiters.push_back(S::waiter{queue(q, /*addRef=*/true), std::move(fn)});
+      return;
+    }
+    --self->value;
+  }
+  fn();
+}
 
 
 // ------------------------------------------------------------------------------------------------
@@ -302,6 +1331,7 @@ error::error(const std::string& msg, int code) : error(new S(code, msg)) {}
 error::error(std::string&& msg, int code) : error(new S(code, msg)) {}
 void error::dealloc(S* self) { delete self; }
 int error::code() const { return self->code; }
+bool error::timed_out() const { return self->code == UV_ETIMEDOUT; }
 const std::string& error::message() const { return self->msg; }
 
 
@@ -311,11 +1341,47 @@ const std::string& error::message() const { return self->msg; }
 #pragma mark - tls_context
 
 
+// Max number of endpoints a context remembers client sessions for
+static const size_t tls_client_session_cache_size = 1024;
+
 struct tls_context::S : ref_counted {
   SSL_CTX* ssl_handle;
+
+  // The most recent session for each endpoint we have connected to as a client, offered to the
+  // server for resumption on the next connection to the same endpoint. Contexts are shared between
+  // queues, so access is guarded by `sessions_lock`.
+  Spinlock sessions_lock = SB_SPINLOCK_INIT;
+  std::unordered_map<std::string,SSL_SESSION*> sessions;
+
+  // Takes over the reference to `sess`
+  void store_session(const std::string& peer, SSL_SESSION* sess) {
+    ScopedSpinlock lock(sessions_lock);
+    auto it = sessions.find(peer);
+    if (it != sessions.end()) {
+      SSL_SESSION_free(it->second);
+      it->second = sess;
+      return;
+    }
+    if (sessions.size() == tls_client_session_cache_size) {
+      SSL_SESSION_free(sessions.begin()->second);
+      sessions.erase(sessions.begin());
+    }
+    sessions.emplace(peer, sess);
+  }
+
+  void resume_session(SSL* ssl, const std::string& peer) {
+    ScopedSpinlock lock(sessions_lock);
+    auto it = sessions.find(peer);
+    if (it != sessions.end()) {
+      SSL_set_session(ssl, it->second); // retains the session
+    }
+  }
 };
 
 
+static int tls_on_new_session(SSL* ssl, SSL_SESSION* sess);
+
+
 tls_context::tls_context() : tls_context(new S) {
   static once_flag o;
   once(o, []{
@@ -332,22 +1398,236 @@ tls_context::tls_context() : tls_context(new S) {
     ERR_print_errors_fp(stderr);
     abort();
   }
+
+  // Servers keep sessions in OpenSSL's internal cache and issue session tickets (enabled by
+  // default). Client sessions are handed to tls_on_new_session, which keeps them per endpoint.
+  static const unsigned char session_id_context[] = "hi";
+  SSL_CTX_set_session_id_context(self->ssl_handle, session_id_context,
+                                 sizeof(session_id_context) - 1);
+  SSL_CTX_set_session_cache_mode(self->ssl_handle, SSL_SESS_CACHE_BOTH);
+  SSL_CTX_sess_set_new_cb(self->ssl_handle, tls_on_new_session);
 }
 
 
 void tls_context::dealloc(S* self) {
+  for (auto& e : self->sessions) {
+    SSL_SESSION_free(e.second);
+  }
   SSL_CTX_free(self->ssl_handle);
   delete self;
 }
 
 
-void tls_context::load_ca_cert_file(const char* path) {
-  // int r = SSL_CTX_use_PrivateKey(self->ssl_handle, EVP_PKEY *pkey);
+static error tls_error();
+
+
+error tls_context::load_ca_cert_file(const char* path) {
   // int SSL_CTX_load_verify_locations(SSL_CTX *ssl_handle, const char *CAfile, const char *CApath);
-  int r = SSL_CTX_load_verify_locations(self->ssl_handle, path, NULL);
-  if (r == 0) {
-    ERR_print_errors_fp(stderr);
-    assert(r != 0);
+  if (SSL_CTX_load_verify_locations(self->ssl_handle, path, NULL) == 0) {
+    return tls_error();
+  }
+  return nullptr;
+}
+
+
+error tls_context::load_cert_file(const char* path) {
+  if (SSL_CTX_use_certificate_chain_file(self->ssl_handle, path) == 0) {
+    return tls_error();
+  }
+  return nullptr;
+}
+
+
+error tls_context::load_private_key_file(const char* path) {
+  if (SSL_CTX_use_PrivateKey_file(self->ssl_handle, path, SSL_FILETYPE_PEM) == 0 ||
+      SSL_CTX_check_private_key(self->ssl_handle) == 0) {
+    return tls_error();
+  }
+  return nullptr;
+}
+
+
+// ------------------------------------------------------------------------------------------------
+//                                              dns
+// ------------------------------------------------------------------------------------------------
+#pragma mark - dns
+
+typedef std::vector<struct sockaddr_storage> dns_addrs;
+typedef fun<void(error,const dns_addrs&)> dns_resolve_cb;
+
+// Process-wide cache of host name lookups. getaddrinfo doesn't tell us the TTL of records, so
+// entries live for a fixed time. Concurrent lookups of the same name share a single request.
+struct dns_cache {
+  struct waiter {
+    queue           q;
+    dns_resolve_cb  cb;
+  };
+  struct entry {
+    dns_addrs           addrs;
+    error               err;
+    uint64_t            expires = 0;   // uv_hrtime
+    bool                resolving = false;
+    bool                invalidated = false; // cleared while resolving; result isn't cached
+    std::vector<waiter> waiters;       // called when `resolving` finishes
+  };
+
+  static const size_t prune_size = 4096; // expired entries are pruned when there are more
+
+  Spinlock                              lock = SB_SPINLOCK_INIT;
+  std::unordered_map<std::string,entry> entries;
+  size_t                                prune_at = prune_size; // grows with the live entries
+  uint64_t                              ttl = 60 * 1000000000ull;
+  uint64_t                              negative_ttl = 5 * 1000000000ull;
+};
+
+static dns_cache& dns() {
+  static dns_cache* cache = new dns_cache; // never deleted, as it may be used during exit
+  return *cache;
+}
+
+
+void set_dns_cache_ttl(double ttl, double negative_ttl) {
+  dns_cache& c = dns();
+  ScopedSpinlock lock(c.lock);
+  c.ttl = static_cast<uint64_t>(ttl * 1000000000.0);
+  c.negative_ttl = static_cast<uint64_t>(negative_ttl * 1000000000.0);
+}
+
+
+void clear_dns_cache() {
+  dns_cache& c = dns();
+  ScopedSpinlock lock(c.lock);
+  for (auto it = c.entries.begin(); it != c.entries.end(); ) {
+    if (it->second.resolving) {
+      it->second.invalidated = true; // keep the waiters, but don't cache the result
+      ++it;
+    } else {
+      it = c.entries.erase(it);
+    }
+  }
+  c.prune_at = dns_cache::prune_size;
+}
+
+
+// Order addresses so that address families alternate, starting with the family of the first
+// address. If connecting to an address fails, the next one tried is of the other family.
+static dns_addrs dns_interleave(const struct addrinfo* ai) {
+  dns_addrs first, second;
+  int first_family = ai->ai_family;
+  for (; ai != nullptr; ai = ai->ai_next) {
+    if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6) {
+      continue;
+    }
+    struct sockaddr_storage ss;
+    memset((void*)&ss, 0, sizeof(ss));
+    memcpy((void*)&ss, (const void*)ai->ai_addr, ai->ai_addrlen);
+    (ai->ai_family == first_family ? first : second).push_back(ss);
+  }
+  dns_addrs addrs;
+  addrs.reserve(first.size() + second.size());
+  for (size_t i = 0; i != HI_MAX(first.size(), second.size()); ++i) {
+    if (i < first.size()) { addrs.push_back(first[i]); }
+    if (i < second.size()) { addrs.push_back(second[i]); }
+  }
+  return addrs;
+}
+
+
+struct dns_res_job {
+  uv_getaddrinfo_t req;
+  std::string      key;
+};
+
+
+// Store the result of a lookup and pass it to everyone waiting for it
+static void dns_finish(const std::string& key, error err, const dns_addrs& addrs) {
+  std::vector<dns_cache::waiter> waiters;
+  dns_cache& c = dns();
+  {
+    ScopedSpinlock lock(c.lock);
+    dns_cache::entry& e = c.entries[key];
+    e.addrs = addrs;
+    e.err = err;
+    e.expires = e.invalidated ? 0 : uv_hrtime() + (err == nullptr ? c.ttl : c.negative_ttl);
+    e.resolving = false;
+    e.invalidated = false;
+    std::swap(waiters, e.waiters);
+  }
+
+  for (dns_cache::waiter& w : waiters) {
+    if (w.q.is_current()) {
+      w.cb(err, addrs);
+    } else {
+      dns_resolve_cb cb = std::move(w.cb);
+      w.q.async([=]{ cb(err, addrs); });
+    }
+  }
+}
+
+
+static void dns_on_resolve(uv_getaddrinfo_t *req, int status, struct addrinfo* ai) {
+  dns_res_job* job = static_cast<dns_res_job*>(req->data);
+  error err;
+  dns_addrs addrs;
+  if (status == 0 && ai != nullptr) {
+    addrs = dns_interleave(ai);
+  }
+  if (addrs.empty()) {
+    err = (status != 0) ? loop_error(req->loop) : error("No addresses", UV_ENOENT);
+  }
+  if (ai != nullptr) { uv_freeaddrinfo(ai); }
+  dns_finish(job->key, err, addrs);
+  record_delete(job);
+}
+
+
+// Resolve `hostname` and `port` into addresses, from the cache when possible. Must be called on
+// `q`, which is where `cb` is called.
+static void dns_resolve(const queue& q, const std::string& hostname, const std::string& port,
+                        dns_resolve_cb cb) {
+  std::string key = hostname + '/' + port;
+  dns_cache& c = dns();
+  spinlock_lock(c.lock);
+  uint64_t now = uv_hrtime();
+  if (c.entries.size() > c.prune_at) {
+    for (auto it = c.entries.begin(); it != c.entries.end(); ) {
+      it = (it->second.resolving || it->second.expires > now) ? std::next(it) : c.entries.erase(it);
+    }
+    // Entries still live are skipped until as many again have been added, so that a cache full of
+    // live entries isn't scanned on every lookup
+    c.prune_at = HI_MAX(dns_cache::prune_size, c.entries.size() * 2);
+  }
+  dns_cache::entry& e = c.entries[key];
+  if (!e.resolving && e.expires > now) {
+    // Cache hit
+    dns_addrs addrs = e.addrs;
+    error err = e.err;
+    spinlock_unlock(c.lock);
+    cb(err, addrs);
+    return;
+  }
+  e.waiters.push_back(dns_cache::waiter{q, cb});
+  if (e.resolving) {
+    // Someone else is already looking this up
+    spinlock_unlock(c.lock);
+    return;
+  }
+  e.resolving = true;
+  spinlock_unlock(c.lock);
+
+  dns_res_job* job = record_new<dns_res_job>();
+  job->req.data = (void*)job;
+  job->key = key;
+  struct addrinfo hints;
+  memset((void*)&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int r = uv_getaddrinfo(queue_loop(q), &job->req, &dns_on_resolve, hostname.c_str(),
+                         port.c_str(), &hints);
+  if (r != 0) {
+    // Fails all waiters, and is cached like any other failure
+    record_delete(job);
+    dns_finish(key, loop_error(queue_loop(q)), dns_addrs());
   }
 }
 
@@ -366,6 +1646,132 @@ enum class channel_type {
   TCP
 };
 
+
+// Size of the pooled segments that encrypted output is written into. A segment and its data header
+// fill exactly one buffer pool block.
+static const size_t tls_write_segment_size = 16384;
+
+// The I/O buffers of a TLS session. Encrypted input is fed in as the very data objects read from
+// the socket, and encrypted output is produced into pooled segments which are written to the
+// socket as they are. OpenSSL reads from and writes to these through a custom BIO (tls_bio_method),
+// so no bytes are copied in and out of memory BIOs.
+struct tls_bio {
+  std::vector<data> in;            // received bytes not yet consumed by OpenSSL
+  size_t            in_offset = 0; // bytes of in[0] already consumed
+  size_t            in_size = 0;   // bytes available in `in`
+  std::vector<data> out;           // produced bytes waiting to be written
+  size_t            out_size = 0;
+
+  void feed(data&& d) {
+    in_size += d.size();
+    in.emplace_back(std::move(d));
+  }
+
+  int read(char* buf, int len) {
+    size_t n = 0;
+    while (n != (size_t)len && !in.empty()) {
+      const data& d = in.front();
+      size_t z = HI_MIN((size_t)len - n, d.size() - in_offset);
+      memcpy(buf + n, d.bytes() + in_offset, z);
+      n += z;
+      in_offset += z;
+      if (in_offset == d.size()) {
+        in.erase(in.begin());
+        in_offset = 0;
+      }
+    }
+    in_size -= n;
+    return (int)n;
+  }
+
+  int write(const char* buf, int len) {
+    size_t n = 0;
+    while (n != (size_t)len) {
+      if (out.empty() || out.back().size() == out.back().capacity()) {
+        out.emplace_back(data_alloc(tls_write_segment_size));
+      }
+      data& d = out.back();
+      size_t z = HI_MIN((size_t)len - n, d.capacity() - d.size());
+      memcpy(d->bytes() + d.size(), buf + n, z);
+      d->set_size(d.size() + z);
+      n += z;
+    }
+    out_size += n;
+    return len;
+  }
+
+  // Segments produced so far, to be written in order
+  std::vector<data> take_output() {
+    std::vector<data> segments;
+    std::swap(segments, out);
+    out_size = 0;
+    return segments;
+  }
+};
+
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+// BIO accessors added by OpenSSL 1.1, which made the BIO struct opaque
+static inline void* BIO_get_data(BIO* b) { return b->ptr; }
+static inline void BIO_set_data(BIO* b, void* p) { b->ptr = p; }
+static inline void BIO_set_init(BIO* b, int init) { b->init = init; }
+#endif
+
+static int tls_bio_write(BIO* b, const char* buf, int len) {
+  BIO_clear_retry_flags(b);
+  return static_cast<tls_bio*>(BIO_get_data(b))->write(buf, len);
+}
+
+static int tls_bio_read(BIO* b, char* buf, int len) {
+  BIO_clear_retry_flags(b);
+  int n = static_cast<tls_bio*>(BIO_get_data(b))->read(buf, len);
+  if (n == 0) {
+    BIO_set_retry_read(b); // come back when more data has been fed
+    return -1;
+  }
+  return n;
+}
+
+static long tls_bio_ctrl(BIO* b, int cmd, long num, void* ptr) {
+  tls_bio* io = static_cast<tls_bio*>(BIO_get_data(b));
+  switch (cmd) {
+    case BIO_CTRL_PENDING:  return (long)io->in_size;
+    case BIO_CTRL_WPENDING: return (long)io->out_size;
+    case BIO_CTRL_FLUSH:    return 1;
+    default:                return 0;
+  }
+}
+
+static int tls_bio_create(BIO* b) {
+  BIO_set_init(b, 1);
+  BIO_set_data(b, nullptr);
+  return 1;
+}
+
+static int tls_bio_destroy(BIO* b) {
+  return 1; // the tls_bio is owned by the TLS session
+}
+
+static BIO_METHOD* tls_bio_method() {
+  #if OPENSSL_VERSION_NUMBER < 0x10100000L
+  static BIO_METHOD m = {
+    BIO_TYPE_SOURCE_SINK, "hi", tls_bio_write, tls_bio_read, nullptr, nullptr, tls_bio_ctrl,
+    tls_bio_create, tls_bio_destroy, nullptr };
+  return &m;
+  #else
+  static BIO_METHOD* m = []{
+    BIO_METHOD* m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "hi");
+    BIO_meth_set_write(m, tls_bio_write);
+    BIO_meth_set_read(m, tls_bio_read);
+    BIO_meth_set_ctrl(m, tls_bio_ctrl);
+    BIO_meth_set_create(m, tls_bio_create);
+    BIO_meth_set_destroy(m, tls_bio_destroy);
+    return m;
+  }();
+  return m;
+  #endif
+}
+
 // channel state
 struct channel::S : ref_counted {
   channel_type  _type;
@@ -379,9 +1785,10 @@ struct channel::S : ref_counted {
     channel_read_cb cb = 0;
     size_t          max_size = 0;
     bool            reading = false;
+    timer           deadline; // fails the read if nothing is received in time
 
     void begin(const channel* c, channel_read_cb f, size_t z) {
-      ch = c; cb = f; max_size = (z == 0) ? SIZE_MAX : z; }
+      ch = c; cb = f; max_size = (z == 0) ? SIZE_MAX : z; reading = true; }
     void stop() {
       if (reading) {
         uv_read_stop(ch->self->_stream);
@@ -392,15 +1799,18 @@ struct channel::S : ref_counted {
       // std::cerr << "read_context::end @ " << (void*)this << " self=" << (void*)ch->self << "\n";
       if (ch != nullptr) {
         stop();
+        if (deadline != nullptr) {
+          deadline.cancel();
+          deadline = nullptr;
+        }
 
         // Note: There once was a bug here where the channel was captured by `cb`, and the callsite
-        // that called this function (end()) was the `cb` implementation. We capture a local
-        // reference to the channel here, so that it's guaranteed to exists at least until this
+        // that called this function (end()) was the `cb` implementation. We move the reference to
+        // the channel into a local here, so that it's guaranteed to exists at least until this
         // call returns.
-        channel chlocal = ch;
+        channel chlocal = std::move(ch);
 
         cb = nullptr; assert((bool)cb == false);
-        ch = nullptr;
       }
     }
     bool active() { return ch != nullptr; }
@@ -411,22 +1821,81 @@ struct channel::S : ref_counted {
   struct tls_session {
     tls_context ctx;
     SSL* session;
-    BIO* in_bio;
-    BIO* out_bio;
+    tls_bio io;
     tls_init_job* init_job = nullptr;
+    std::string peer; // endpoint of the server when in client mode, empty in server mode
 
-    tls_session(tls_context c) : ctx(c) {
+    tls_session(tls_context c, const std::string& p = std::string()) : ctx(c), peer(p) {
       // Note: SSL_clear <= "reset SSL object to allow another connection"
       session = SSL_new(ctx->self->ssl_handle);
-      in_bio = BIO_new(BIO_s_mem());
-      out_bio = BIO_new(BIO_s_mem());
-      SSL_set_bio(session, in_bio, out_bio);
+      BIO* bio = BIO_new(tls_bio_method());
+      BIO_set_data(bio, &io);
+      SSL_set_bio(session, bio, bio);
+      SSL_set_app_data(session, this);
+      if (is_server()) {
+        SSL_set_accept_state(session);
+      } else {
+        SSL_set_connect_state(session);
+        ctx->self->resume_session(session, peer);
+      }
     }
+    bool is_server() const { return peer.empty(); }
     ~tls_session() { SSL_free(session); /* frees the BIOs too */ }
     bool is_initiated() const { return SSL_is_init_finished(session); }
     void init_end(error e = nullptr); // not impl here since need access to init_job struct
   } * tls = nullptr;
 
+  // Writes buffered while the channel is corked. Flushed as a single vectored write by uncork().
+  struct cork_buffer {
+    unsigned                      depth = 0;
+    size_t                        nbytes = 0;
+    std::vector<data>             bufs;
+    std::vector<fun<void(error)>> cbs;
+
+    void append(data&& d, const fun<void(error)>& cb) {
+      nbytes += d.size();
+      bufs.emplace_back(std::move(d));
+      if ((bool)cb) { cbs.push_back(cb); }
+    }
+  } _cork;
+
+  // Write flow control. `full` is set when the write queue grows to `high` bytes and cleared, with
+  // a call to `on_drain`, when it has shrunk to `low` bytes.
+  struct write_watermarks {
+    size_t      high = 0; // 0 means flow control is disabled
+    size_t      low = 0;
+    bool        full = false;
+    fun<void()> on_drain;
+  } _wm;
+
+  size_t write_queue_size() const {
+    return (_stream != nullptr ? _stream->write_queue_size : 0) + _cork.nbytes;
+  }
+
+  // Timeouts in uv_hrtime nanoseconds, 0 meaning none. Rather than rescheduling timers for every
+  // read and write, the times of the last ones are recorded and checked when a timer fires.
+  struct timeouts {
+    uint64_t read = 0;
+    uint64_t idle = 0;
+    uint64_t last_read = 0;  // data received
+    uint64_t last_write = 0; // write completed
+    timer    idle_timer;     // while open, if there's an idle timeout
+    timer    connect_timer;  // while connecting, if there's a connect timeout
+    bool     connect_timed_out = false;
+  } _timeouts;
+
+  // State of a listening channel
+  struct listener {
+    channel              ch;             // keeps the channel alive while listening
+    channel_connect_cb   cb;
+    tls_context          tls;            // accepted channels are TLS servers unless nullptr
+    std::vector<queue>   queues;         // queues that accepted channels are spread across
+    size_t               next_queue = 0;
+    std::vector<channel> siblings;       // SO_REUSEPORT listeners on the other queues
+    listener(channel c, channel_connect_cb f, tls_context t, const std::vector<queue>& qs)
+      : ch(c), cb(f), tls(t), queues(qs) {}
+  } * _listener = nullptr;
+
   S(channel_type t, queue q) : _type(t), _q(q) {}
   // ~S() { std::cerr << "channel::S::~S @ " << (void*)this << "\n"; }
 };
@@ -436,6 +1905,11 @@ tls_context channel::tls() const {
 }
 
 
+bool channel::tls_session_reused() const {
+  return self->tls != nullptr && SSL_session_reused(self->tls->session);
+}
+
+
 channel::channel() : self(0) {}
 
 
@@ -443,6 +1917,7 @@ void channel::dealloc(S* self) {
   // std::cerr << "channel::dealloc @ " << (void*)self << "\n";
   if (self->_stream != 0) { delete self->_stream; }
   if (self->tls) { delete self->tls; }
+  if (self->_listener) { delete self->_listener; }
   delete self;
 }
 
@@ -490,15 +1965,10 @@ std::string channel::endpoint_name() const {
 #endif
 
 
-static const size_t tls_init_read_buf_size = 2048;
-
 struct tls_init_job {
   channel             ch;
   channel_connect_cb  cb;
-  char                read_buf[tls_init_read_buf_size];
-  tls_init_job(channel c, channel_connect_cb f) : ch(c), cb(f) {
-    assert((read_buf[tls_init_read_buf_size-1] = 0) == 0); // purely for assertions
-  }
+  tls_init_job(channel c, channel_connect_cb f) : ch(c), cb(f) {}
 };
 
 
@@ -519,117 +1989,120 @@ static error tls_error() {
 }
 
 
-static void tls_flush_out_bio(channel::S* self) {
-  // std::cout << "flush_out_bio()\n";
-  BIO* out_bio = self->tls->out_bio;
+// Called after data has been queued for writing
+static void channel_did_queue_write(channel::S* self) {
+  if (self->_wm.high != 0 && !self->_wm.full && self->write_queue_size() >= self->_wm.high) {
+    self->_wm.full = true;
+  }
+}
 
-  while (BIO_pending(out_bio) != 0) {
-    static const size_t BUF_SIZE = 4096;
-    char* p = (char*)malloc(BUF_SIZE);
-    uv_write_t* req = (uv_write_t*)p;
-    char* buf = p + sizeof(uv_write_t);
 
-    int bytes_read = BIO_read(out_bio, buf, BUF_SIZE);
-    // std::cout << "flush_out_bio(): bytes_read => " << bytes_read << "\n";
-    if (bytes_read < 1) {
-      // buffer is empty
-      free((void*)req);
-      break;
+// Called from write completion callbacks
+static void channel_did_write(uv_write_t* req) {
+  if (uv_is_closing((uv_handle_t*)req->handle)) {
+    return; // handle->data no longer points to the channel
+  }
+  channel::S* self = static_cast<channel::S*>(req->handle->data);
+  self->_timeouts.last_write = uv_hrtime();
+  if (self->_wm.full && self->write_queue_size() <= self->_wm.low) {
+    self->_wm.full = false;
+    if ((bool)self->_wm.on_drain) {
+      self->_wm.on_drain();
     }
+  }
+}
 
-    uv_buf_t uvbuf = { .base = buf, .len = static_cast<size_t>(bytes_read) };
-    // req->data = (void*)self;
-    int r = uv_write(req, self->_stream, &uvbuf, 1, [](uv_write_t* req, int status) {
-      assert(status == 0); // TODO
-      free((void*)req);
-    });
 
-    if (r != 0) {
-      assert(r == 0); // TODO
-      free((void*)req);
-      break;
-    }
-  }
-  // std::cout << "flush_out_bio() DONE\n";
-};
+// Max amount of plaintext in a TLS record
+static const size_t tls_max_record_size = 16384;
 
 
-static void tls_client_negotiate(channel::S* self) {
-  // Negotiate the TLS handshake with a TLS server
-  channel::S::tls_session& tls = *self->tls;
-  // std::cout << "[tls_negotiate] SSL_is_init_finished => "
-  //           << SSL_is_init_finished(tls.session) << "\n";
-  
-  int r = SSL_connect(tls.session);
-  // std::cout << "[tls_negotiate] SSL_connect => " << r << "\n";
-
-  if (r < 0) {
-    // Still negotiating the connection
-    if (SSL_get_error(tls.session, r) == SSL_ERROR_WANT_READ) {
-      tls_flush_out_bio(self);
-    } else {
-      tls.init_end(tls_error());
+static void channel_writev(channel::S* self, std::vector<data>&& bufs, fun<void(error)> cb);
+
+// Write all encrypted output produced so far, as a single vectored write of the output segments.
+// `cb` is called once it has been written, or with the error that prevented it.
+static void tls_flush(channel::S* self, fun<void(error)> cb) {
+  std::vector<data> segments = self->tls->io.take_output();
+  if (segments.empty()) {
+    if ((bool)cb) {
+      self->_q.async([=]{ cb(nullptr); }); // nothing to write, e.g. for an empty write
     }
-  } else {
-    // TLS/SSL session has been established
-    uv_read_stop(self->_stream);
-    tls.init_end();
+    return;
   }
-};
+  channel_writev(self, std::move(segments), cb);
+}
+
 
+// Called by OpenSSL when a session has been established, or when a session ticket has arrived
+static int tls_on_new_session(SSL* ssl, SSL_SESSION* sess) {
+  auto tls = static_cast<channel::S::tls_session*>(SSL_get_app_data(ssl));
+  if (tls == nullptr || tls->is_server()) {
+    return 0; // OpenSSL caches server sessions itself
+  }
+  tls->ctx->self->store_session(tls->peer, sess);
+  return 1; // we took over the reference to `sess`
+}
 
-static void tls_client_init(const channel& ch) {
-  channel::S::tls_session& tls = *ch->self->tls;
 
-  // prepare SSL object to work in client mode
-  SSL_set_connect_state(tls.session);
+// Advance the TLS handshake. Returns true while the handshake is waiting for more data from the
+// peer. Otherwise the handshake has completed or failed and init_end() has been called.
+static bool tls_negotiate(channel::S* self) {
+  channel::S::tls_session& tls = *self->tls;
 
-  // Initiate TLS/SSL handshake
   int r = SSL_do_handshake(tls.session);
-  if (r != 1) {
-    // r=0 The TLS/SSL handshake was not successful but was shut down controlled and by the
-    //     specifications of the TLS/SSL protocol. Call SSL_get_error() with the return value ret
-    //     to find out the reason.
-    //
-    // r=1 The TLS/SSL handshake was successfully completed, a TLS/SSL connection has been
-    //     established.
-    //
-    // r<0 The TLS/SSL handshake was not successful because a fatal error occurred either at the
-    //     protocol level or a connection failure occurred. The shutdown was not clean. It can also
-    //     occur of action is need to continue the operation for non-blocking BIOs. Call
-    //     SSL_get_error() with the return value ret to find out the reason.
-    
-    if (SSL_get_error(tls.session, r) == SSL_ERROR_WANT_READ) {
-      tls_flush_out_bio(ch->self);
-    } else {
-      // Actual error
-      tls.init_end(tls_error());
-      return;
+  // r=1 The TLS/SSL handshake was successfully completed, a TLS/SSL connection has been
+  //     established.
+  //
+  // r=0 The TLS/SSL handshake was not successful but was shut down controlled and by the
+  //     specifications of the TLS/SSL protocol.
+  //
+  // r<0 The TLS/SSL handshake was not successful because a fatal error occurred, or because
+  //     action is needed to continue the operation for non-blocking BIOs. SSL_get_error() tells
+  //     which.
+
+  // Send whatever the handshake produced. This includes the last flight of a completed
+  // handshake, e.g. the client's Finished message in TLS 1.3 or a server's session ticket. A
+  // failed write ends the handshake unless it has already ended.
+  if (tls.io.out_size != 0) {
+    channel ch(self, /*addRef=*/true);
+    tls_flush(self, [ch](error err) {
+      channel::S* self = ch.self;
+      if (err != nullptr && self->_stream != nullptr && self->tls->init_job != nullptr) {
+        uv_read_stop(self->_stream);
+        self->tls->init_end(err);
+      }
+    });
+    if (tls.init_job == nullptr) {
+      return false; // the write failed right away and ended the handshake
     }
+  }
 
-    // int e = SSL_get_error(tls.session, r);
-    // std::cout << "r=" << r << ", e=" << e << "\n";
-    // tls.init_end(tls_error());
-    // return;
+  if (r != 1 && SSL_get_error(tls.session, r) == SSL_ERROR_WANT_READ) {
+    return true;
   }
-  
+  uv_read_stop(self->_stream);
+  tls.init_end(r == 1 ? nullptr : tls_error());
+  return false;
+}
+
+
+static void tls_handshake_init(const channel& ch) {
+  // Initiate TLS/SSL handshake. The session is already in client or server mode.
   TLS_TRACE
-  tls_client_negotiate(ch->self);
+  if (!tls_negotiate(ch->self)) {
+    return;
+  }
 
   // Start reading
   assert(ch->self->_rctx.active() == false);
   assert(ch->self->_stream != 0);
-  r = uv_read_start(ch->self->_stream,
+  int r = uv_read_start(ch->self->_stream,
 
     // Allocate new buffer
     [](uv_handle_t *handle, size_t suggested_size) -> uv_buf_t {
-      // return uv_buf_init((char*)malloc(2048), 2048);
-      channel::S* self = static_cast<channel::S*>(handle->data);
-      // Note: We are writing in sequence to BIO, so we have a single buffer that we reuse
-      char* buf = self->tls->init_job->read_buf;
-      size_t z = tls_init_read_buf_size;
-      assert(buf[--z] == 0 && (buf[z] = 1)); // exclusive access marker
-      return uv_buf_init(buf, z);
+      // Handshake records are fed to the TLS session in the buffers they were read into
+      data::S* d = data_alloc(suggested_size);
+      return uv_buf_init(d->bytes, d->capacity);
     },
 
     // When data is ready to be read
@@ -637,6 +2110,15 @@ static void tls_client_init(const channel& ch) {
       channel::S* self = static_cast<channel::S*>(stream->data);
       channel::S::tls_session& tls = *self->tls;
       // std::cout << "[tls/negotiate/read] " << nread << "\n";
+      data d;
+      if (buf.base != nullptr) {
+        d = data(data_from_bytes(buf.base)); // takes over the reference from the alloc callback
+      }
+      if (nread > 0) {
+        d->set_size((size_t)nread);
+        tls.io.feed(std::move(d));
+      }
+
       switch (nread) {
         case -1: {
           uv_read_stop(stream);
@@ -653,102 +2135,195 @@ static void tls_client_init(const channel& ch) {
           break;
         }
         default: {
-          int written = BIO_write(tls.in_bio, buf.base, nread);
-          // std::cout << "[tls/read] BIO_write => " << written << "\n";
-          assert(written >= 0); // since its in memory-mode writing should never fail
           assert(tls.is_initiated() == false);
-          tls_client_negotiate(self);
+          tls_negotiate(self);
           break;
         }
       } // switch (nread)
-
-      assert(buf.base[tls_init_read_buf_size-1] == 1); // exclusive access marker
-      assert((buf.base[tls_init_read_buf_size-1] = 0) == 0); // exclusive access marker
     }
   );
 
   if (r != 0) {
     // uv_read_start error
-    tls.init_end(loop_error(ch->self->_stream->loop));
+    ch->self->tls->init_end(loop_error(ch->self->_stream->loop));
   }
 }
 
 
+// Attempts to connect to the addresses a host name resolved to. When an attempt hasn't completed
+// after connect_attempt_delay, the next address is tried alongside it, and the first to connect
+// wins (RFC 8305). The channel's _stream is always one of the pending attempts, so that closing
+// the channel cancels the whole race. Only used from the channel's queue.
+struct connect_race;
+
 struct connect_job {
-  channel             ch;
-  channel_connect_cb  cb;
-  uv_connect_t        req;
-  connect_job(channel c, channel_connect_cb f) : ch(c), cb(f) {}
+  connect_race* race;
+  uv_tcp_t*     tcp;
+  uv_connect_t  req;
 };
 
+struct connect_race {
+  channel                   ch;
+  channel_connect_cb        cb;
+  dns_addrs                 addrs;
+  size_t                    next = 0;  // address to try next
+  std::vector<connect_job*> jobs;      // attempts whose callback hasn't been called yet
+  timer                     delay_timer;
+  error                     err;       // of the latest attempt to fail
+  bool                      done = false;
+  connect_race(channel c, channel_connect_cb f, dns_addrs&& a)
+    : ch(c), cb(f), addrs(std::move(a)) {}
+};
 
-static void connect_tcp_on_open(uv_connect_t* req, int status) {
-  connect_job* job = static_cast<connect_job*>(req->data);
-  if (status != 0) {
-    if (uv_last_error(req->handle->loop).code == UV_ECANCELED) {
-      // Connection was canceled. Don't invoke callback.
-    } else {
-      // Error occured
-      job->cb(loop_error(req->handle->loop), job->ch);
-    }
-  } else {
-    if (job->ch->self->tls != nullptr) {
-      // TLS, please
-      assert(job->ch->self->tls->init_job == nullptr);
-      job->ch->self->tls->init_job = new tls_init_job(job->ch, job->cb);
-      tls_client_init(job->ch);
-    } else {
-      // We are connected
-      job->cb(nullptr, job->ch);
+static const double connect_attempt_delay = 0.25; // seconds
+
+
+// Stop all attempts except the one using `winner`, which can be null. The race is deleted once the
+// callbacks of the stopped attempts have been called.
+static void connect_race_end(connect_race* race, uv_tcp_t* winner) {
+  race->done = true;
+  if (race->delay_timer != nullptr) {
+    race->delay_timer.cancel();
+    race->delay_timer = nullptr;
+  }
+  for (connect_job* job : race->jobs) {
+    if (job->tcp != winner && !uv_is_closing((uv_handle_t*)job->tcp)) {
+      uv_close((uv_handle_t*)job->tcp, [](uv_handle_t* handle) { delete (uv_tcp_t*)handle; });
     }
   }
-  delete job;
+  if (race->jobs.empty()) {
+    record_delete(race);
+  }
 }
 
 
-static void connect_tcp_step2(const queue& q, channel ch, struct sockaddr* sa,
-                              channel_connect_cb cb) {
-  uv_loop_t* loop = queue_loop(q);
-  uv_tcp_t* tcp_stream = new uv_tcp_t;
-  tcp_stream->data = ch.self;
-  ch.self->_stream = (uv_stream_t*)tcp_stream;
+static void connect_tcp_on_open(uv_connect_t* req, int status);
 
-  int r = uv_tcp_init(loop, tcp_stream);
-  if (r != 0) {
-    delete (uv_tcp_t*)ch.self->_stream; ch.self->_stream = 0;
-    cb(loop_error(loop), ch);
-    return;
-  }
 
-  connect_job* job = new connect_job(ch, cb);
-  job->req.data = job;
+// Start connecting to the next address that can be connected to
+static void connect_tcp_start(connect_race* race) {
+  channel::S* self = race->ch.self;
+  uv_loop_t* loop = queue_loop(self->_q);
 
-  if (sa->sa_family == AF_INET) {
-    r = uv_tcp_connect(&job->req, tcp_stream, *((struct sockaddr_in*)sa), connect_tcp_on_open);
-  } else {
-    assert(sa->sa_family == AF_INET6);
-    r = uv_tcp_connect6(&job->req, tcp_stream, *((struct sockaddr_in6*)sa), connect_tcp_on_open);
+  while (race->next < race->addrs.size()) {
+    const struct sockaddr_storage& ss = race->addrs[race->next++];
+    uv_tcp_t* tcp = new uv_tcp_t;
+    if (uv_tcp_init(loop, tcp) != 0) {
+      race->err = loop_error(loop);
+      delete tcp;
+      continue;
+    }
+    tcp->data = self;
+
+    connect_job* job = record_new<connect_job>();
+    job->race = race;
+    job->tcp = tcp;
+    job->req.data = job;
+    int r;
+    if (ss.ss_family == AF_INET) {
+      r = uv_tcp_connect(&job->req, tcp, *((struct sockaddr_in*)&ss), connect_tcp_on_open);
+    } else {
+      assert(ss.ss_family == AF_INET6);
+      r = uv_tcp_connect6(&job->req, tcp, *((struct sockaddr_in6*)&ss), connect_tcp_on_open);
+    }
+    if (r != 0) {
+      race->err = loop_error(loop);
+      record_delete(job);
+      uv_close((uv_handle_t*)tcp, [](uv_handle_t* handle) { delete (uv_tcp_t*)handle; });
+      continue;
+    }
+
+    race->jobs.push_back(job);
+    self->_stream = (uv_stream_t*)tcp;
+    if (race->delay_timer != nullptr) {
+      race->delay_timer.cancel();
+      race->delay_timer = nullptr;
+    }
+    if (race->next < race->addrs.size()) {
+      race->delay_timer = self->_q.after(connect_attempt_delay, [race]{
+        race->delay_timer = nullptr;
+        if (race->ch.self->_stream != nullptr) { // else closed, and the race ends when canceled
+          connect_tcp_start(race);
+        }
+      });
+    }
+    return;
   }
 
-  if (r != 0) {
-    delete job;
-    delete (uv_tcp_t*)ch.self->_stream; ch.self->_stream = 0;
-    cb(loop_error(loop), ch);
+  if (race->jobs.empty()) {
+    // Nothing left to try
+    channel ch = race->ch;
+    channel_connect_cb cb = race->cb;
+    error err = race->err;
+    self->_stream = nullptr;
+    connect_race_end(race, nullptr);
+    cb(err, ch);
   }
 }
 
 
-struct dns_res_job {
-  uv_getaddrinfo_t req;
-  fun<void(error, struct sockaddr*)> cb;
-};
+static void connect_tcp_on_open(uv_connect_t* req, int status) {
+  connect_job* job = static_cast<connect_job*>(req->data);
+  connect_race* race = job->race;
+  uv_tcp_t* tcp = job->tcp;
+  channel::S* self = race->ch.self;
+  race->jobs.erase(std::find(race->jobs.begin(), race->jobs.end(), job));
+  record_delete(job);
+
+  if (race->done) {
+    // Lost the race, and was canceled. Don't invoke callback.
+    if (race->jobs.empty()) {
+      record_delete(race);
+    }
+    return;
+  }
+
+  if (self->_stream == nullptr) {
+    // The channel was closed, which canceled this attempt or another one. Don't invoke callback.
+    if (!uv_is_closing((uv_handle_t*)tcp)) {
+      uv_close((uv_handle_t*)tcp, [](uv_handle_t* handle) { delete (uv_tcp_t*)handle; });
+    }
+    connect_race_end(race, nullptr);
+    return;
+  }
+
+  if (status != 0) {
+    race->err = loop_error(tcp->loop);
+    if (race->next == race->addrs.size() && race->jobs.empty()) {
+      // Error occured. The handle of the last attempt is left to the channel.
+      channel ch = race->ch;
+      channel_connect_cb cb = race->cb;
+      error err = race->err;
+      self->_stream = (uv_stream_t*)tcp;
+      connect_race_end(race, tcp);
+      cb(err, ch);
+      return;
+    }
+    uv_close((uv_handle_t*)tcp, [](uv_handle_t* handle) { delete (uv_tcp_t*)handle; });
+    if (race->next < race->addrs.size()) {
+      // Try the next address right away instead of waiting for the delay
+      connect_tcp_start(race);
+    } else if (self->_stream == (uv_stream_t*)tcp) {
+      self->_stream = (uv_stream_t*)race->jobs.back()->tcp;
+    }
+    return;
+  }
 
+  // Connected. The other attempts are canceled.
+  channel ch = race->ch;
+  channel_connect_cb cb = race->cb;
+  self->_stream = (uv_stream_t*)tcp;
+  connect_race_end(race, tcp);
 
-static void dns_on_resolve(uv_getaddrinfo_t *req, int status, struct addrinfo* ai) {
-  dns_res_job* job = static_cast<dns_res_job*>(req->data);
-  job->cb( (status == 0 && ai != 0 ? nullptr : loop_error(req->loop)), ai == 0 ? 0 : ai->ai_addr);
-  if (ai != 0) { uv_freeaddrinfo(ai); }
-  delete job;
+  if (self->tls != nullptr) {
+    // TLS, please
+    assert(self->tls->init_job == nullptr);
+    self->tls->init_job = new tls_init_job(ch, cb);
+    tls_handshake_init(ch);
+  } else {
+    // We are connected
+    cb(nullptr, ch);
+  }
 }
 
 
@@ -782,27 +2357,24 @@ static void connect_tcp(const queue& q, channel ch, const std::string& endpoint,
     return;
   }
 
-  // DNS request job
-  dns_res_job* job = new dns_res_job;
-  job->req.data = (void*)job;
-  job->cb = [=](error e, struct sockaddr* sa) {
-    if (e != nullptr) {
-      if (e.code() == UV_ENOENT) {
-        e = error(std::string("Unknown hostname \"") + hostname + '"', UV_ENOENT);
+  auto resolve = [=]{
+    dns_resolve(q, hostname, port, [=](error e, const dns_addrs& addrs) {
+      if (e != nullptr) {
+        if (e.code() == UV_ENOENT) {
+          e = error(std::string("Unknown hostname \"") + hostname + '"', UV_ENOENT);
+        }
+        cb(e, nullptr);
+      } else {
+        connect_tcp_start(record_new<connect_race>(ch, cb, dns_addrs(addrs)));
       }
-      cb(e, nullptr);
-    } else {
-      connect_tcp_step2(q, ch, sa, cb);
-    }
+    });
   };
 
-  // Dispatch
-  // TODO: check q->is_current() and if not, we have to do this in the appropriate queue
-  int r = uv_getaddrinfo(queue_loop(q), &job->req, &dns_on_resolve, hostname.c_str(), port.c_str(),
-                         0);
-  if (r != 0) {
-    delete job;
-    cb(loop_error(queue_loop(q)), ch);
+  // libuv loops must only be used from their own thread
+  if (q.is_current()) {
+    resolve();
+  } else {
+    q.async(resolve);
   }
 }
 
@@ -831,7 +2403,28 @@ channel channel::connect(const std::string& e, channel_connect_cb f) {
 channel channel::connect(const std::string& e, tls_context s, channel_connect_cb f) {
   return connect(nullptr, e, s, f); }
 
-channel channel::connect(queue q, const std::string& endpoint, tls_context s,
+channel channel::connect(queue q, const std::string& e, tls_context s, channel_connect_cb f) {
+  return connect(q, e, s, 0, f); }
+
+
+// Fail a connect that hasn't completed in time. Whatever the connect was doing is stopped, and its
+// callback ignored.
+static void channel_connect_timed_out(channel ch, channel_connect_cb cb) {
+  channel::S* self = ch.self;
+  self->_timeouts.connect_timer = nullptr;
+  self->_timeouts.connect_timed_out = true;
+  if (self->tls != nullptr && self->tls->init_job != nullptr) {
+    uv_read_stop(self->_stream);
+    self->tls->init_end(timeout_error("Connect"));
+  }
+  if (self->_stream != nullptr && !uv_is_closing((uv_handle_t*)self->_stream)) {
+    ch.close(); // cancels a pending TCP connect without calling back
+  }
+  cb(timeout_error("Connect"), nullptr);
+}
+
+
+channel channel::connect(queue q, const std::string& endpoint, tls_context s, double timeout,
                          channel_connect_cb cb) {
   if (q == nullptr) {
     q = hi::main_queue();
@@ -849,7 +2442,37 @@ channel channel::connect(queue q, const std::string& endpoint, tls_context s,
   channel ch(new channel::S(t, q));
 
   if (s != nullptr) {
-    ch.self->tls = new S::tls_session(s);
+    // Client sessions are cached by endpoint, e.g. "example.com:443"
+    ch.self->tls = new S::tls_session(s, endpoint2);
+  }
+
+  if (timeout > 0) {
+    // Whichever comes first of the connect completing and the timer firing calls `cb`
+    channel_connect_cb f = cb;
+    cb = [ch, f](error err, channel c) {
+      if (ch.self->_timeouts.connect_timed_out) {
+        if (err == nullptr) { c.close(); } // connected too late
+        return;
+      }
+      ch.self->_timeouts.connect_timer.cancel();
+      ch.self->_timeouts.connect_timer = nullptr;
+      f(err, c);
+    };
+    // The timer is scheduled and cancelled on the channel's queue, so the connect starts there
+    auto start = [ch, f, cb, timeout, endpoint2]{
+      ch.self->_timeouts.connect_timer = ch.self->_q.after(timeout, [ch, f]{
+        channel_connect_timed_out(ch, f);
+      });
+      switch (ch.self->_type) {
+        case channel_type::TCP: { connect_tcp(ch.self->_q, ch, endpoint2, cb); break; }
+      }
+    };
+    if (q.is_current()) {
+      start();
+    } else {
+      q.async(start);
+    }
+    return ch;
   }
 
   switch (ch.self->_type) {
@@ -859,14 +2482,261 @@ channel channel::connect(queue q, const std::string& endpoint, tls_context s,
 }
 
 
+#if HI_TARGET_OS_LINUX && defined(SO_REUSEPORT)
+  // The kernel balances incoming connections across sockets bound with SO_REUSEPORT, which lets
+  // each queue accept on its own socket. Elsewhere we accept on one queue and hand sockets over.
+  #define HI_CHANNEL_LISTEN_REUSEPORT 1
+#else
+  #define HI_CHANNEL_LISTEN_REUSEPORT 0
+#endif
+
+static const int channel_listen_backlog = 511;
+
+
+static error channel_parse_listen_addr(const std::string& uri, struct sockaddr_storage& ss) {
+  // "ip:port" | "[ip6]:port"
+  std::string name, port;
+  error err = channel_parse_uri_host_port(uri, name, port);
+  if (err != nullptr) {
+    return err;
+  }
+  memset((void*)&ss, 0, sizeof(ss));
+  uint16_t portn = htons(static_cast<uint16_t>(atoi(port.c_str())));
+  uv_err_t e;
+  if (name.find(':') != std::string::npos) {
+    struct sockaddr_in6* sa = (struct sockaddr_in6*)&ss;
+    sa->sin6_family = AF_INET6;
+    sa->sin6_port = portn;
+    e = uv_inet_pton(AF_INET6, name.c_str(), (void*)&sa->sin6_addr);
+  } else {
+    struct sockaddr_in* sa = (struct sockaddr_in*)&ss;
+    sa->sin_family = AF_INET;
+    sa->sin_port = portn;
+    e = uv_inet_pton(AF_INET, name.c_str(), (void*)&sa->sin_addr);
+  }
+  if (e.code != UV_OK) {
+    return error(std::string("Invalid URI: \"") + name + "\" is not an IP address", e.code);
+  }
+  return nullptr;
+}
+
+
+// Create a TCP channel with an initialized but unconnected stream. Must be called on `q`.
+static channel channel_new_tcp(const queue& q) {
+  channel ch(new channel::S(channel_type::TCP, q));
+  uv_tcp_t* tcp_stream = new uv_tcp_t;
+  int r = uv_tcp_init(queue_loop(q), tcp_stream);
+  assert(r == 0); // only fails if the loop is broken
+  tcp_stream->data = ch.self;
+  ch.self->_stream = (uv_stream_t*)tcp_stream;
+  return ch;
+}
+
+
+// Hand an accepted channel to the listen callback, after the TLS handshake if there is one
+static void channel_did_accept(channel ch, tls_context tls, const channel_connect_cb& cb) {
+  if (tls == nullptr) {
+    cb(nullptr, ch);
+    return;
+  }
+  ch.self->tls = new channel::S::tls_session(tls);
+  ch.self->tls->init_job = new tls_init_job(ch, cb);
+  tls_handshake_init(ch);
+}
+
+
+static void channel_on_connection(uv_stream_t* server, int status) {
+  channel::S* self = static_cast<channel::S*>(server->data);
+  channel::S::listener& l = *self->_listener;
+
+  if (status != 0) {
+    l.cb(loop_error(server->loop), nullptr);
+    return;
+  }
+
+  queue q = self->_q;
+  if (!HI_CHANNEL_LISTEN_REUSEPORT && l.queues.size() > 1) {
+    q = l.queues[l.next_queue++ % l.queues.size()];
+  }
+
+  if (q == self->_q) {
+    channel ch = channel_new_tcp(q);
+    if (uv_accept(server, ch.self->_stream) != 0) {
+      l.cb(loop_error(server->loop), nullptr);
+    } else {
+      channel_did_accept(ch, l.tls, l.cb);
+    }
+    return;
+  }
+
+  // A handle can't move between loops, so we take the socket libuv has already accepted instead
+  // of calling uv_accept, and open it in a new handle on the target queue.
+  int fd = server->accepted_fd;
+  server->accepted_fd = -1;
+  channel_connect_cb cb = l.cb;
+  tls_context tls = l.tls;
+  q.async([q, fd, tls, cb]{
+    channel ch = channel_new_tcp(q);
+    if (uv_tcp_open((uv_tcp_t*)ch.self->_stream, fd) != 0) {
+      ::close(fd);
+      cb(loop_error(queue_loop(q)), nullptr);
+    } else {
+      channel_did_accept(ch, tls, cb);
+    }
+  });
+}
+
+
+// Bind and start listening. Must be called on the channel's queue.
+static void channel_listen_start(channel ch, struct sockaddr_storage ss, bool reuseport) {
+  channel::S* self = ch.self;
+  channel::S::listener& l = *self->_listener;
+  if (l.ch == nullptr) {
+    return; // closed before we got to start listening
+  }
+  uv_tcp_t* tcp_stream = new uv_tcp_t;
+  uv_tcp_init(queue_loop(self->_q), tcp_stream);
+  tcp_stream->data = self;
+  self->_stream = (uv_stream_t*)tcp_stream;
+  int r = 0;
+  error err;
+
+  #if HI_CHANNEL_LISTEN_REUSEPORT
+  if (reuseport) {
+    // libuv can't set SO_REUSEPORT, so we create the socket ourselves. uv_tcp_open doesn't make
+    // the socket non-blocking, and libuv accepts until EAGAIN, so it must be non-blocking already.
+    int fd = ::socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int on = 1;
+    if (fd == -1 || ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+      err = error(std::string("socket: ") + strerror(errno), errno);
+      if (fd != -1) { ::close(fd); }
+      r = -1;
+    } else if ((r = uv_tcp_open(tcp_stream, fd)) != 0) {
+      ::close(fd);
+    }
+  }
+  #endif
+
+  if (r == 0) {
+    if (ss.ss_family == AF_INET6) {
+      r = uv_tcp_bind6(tcp_stream, *(struct sockaddr_in6*)&ss);
+    } else {
+      r = uv_tcp_bind(tcp_stream, *(struct sockaddr_in*)&ss);
+    }
+  }
+  if (r == 0) {
+    r = uv_listen((uv_stream_t*)tcp_stream, channel_listen_backlog, channel_on_connection);
+  }
+  if (r != 0) {
+    if (err == nullptr) {
+      err = loop_error(tcp_stream->loop);
+    }
+    self->_stream = nullptr;
+    uv_close((uv_handle_t*)tcp_stream, [](uv_handle_t* handle) { delete (uv_tcp_t*)handle; });
+    channel_connect_cb cb = l.cb;
+    l.ch = nullptr;
+    cb(err, nullptr);
+  }
+}
+
+
+static void channel_listen_on_queue(const channel& ch, const struct sockaddr_storage& ss,
+                                    bool reuseport) {
+  queue q = ch.self->_q;
+  if (q.is_current()) {
+    channel_listen_start(ch, ss, reuseport);
+  } else {
+    q.async([=]{ channel_listen_start(ch, ss, reuseport); });
+  }
+}
+
+
+channel channel::listen(const std::string& e, channel_connect_cb cb) {
+  return listen(std::vector<queue>{main_queue()}, e, nullptr, cb); }
+
+channel channel::listen(const std::string& e, tls_context s, channel_connect_cb cb) {
+  return listen(std::vector<queue>{main_queue()}, e, s, cb); }
+
+channel channel::listen(queue q, const std::string& e, channel_connect_cb cb) {
+  return listen(std::vector<queue>{q}, e, nullptr, cb); }
+
+channel channel::listen(queue q, const std::string& e, tls_context s, channel_connect_cb cb) {
+  return listen(std::vector<queue>{q}, e, s, cb); }
+
+channel channel::listen(const std::vector<queue>& qs, const std::string& e, channel_connect_cb cb) {
+  return listen(qs, e, nullptr, cb); }
+
+channel channel::listen(const std::vector<queue>& queues, const std::string& endpoint,
+                        tls_context s, channel_connect_cb cb) {
+  assert(!queues.empty());
+
+  // parse type from endpoint of format "type:"
+  channel_type t;
+  std::string endpoint2;
+  struct sockaddr_storage ss;
+  error err = channel_parse_uri_type(endpoint, t, endpoint2);
+  if (err == nullptr) {
+    err = channel_parse_listen_addr(endpoint2, ss);
+  }
+  if (err != nullptr) {
+    cb(err, nullptr);
+    return nullptr;
+  }
+
+  // With SO_REUSEPORT every queue gets its own listening socket. Otherwise one socket on the first
+  // queue accepts connections for all queues.
+  bool reuseport = HI_CHANNEL_LISTEN_REUSEPORT && queues.size() > 1;
+
+  channel ch(new channel::S(t, queues[0]));
+  ch.self->_listener = new S::listener(ch, cb, s,
+                                       reuseport ? std::vector<queue>{queues[0]} : queues);
+  if (reuseport) {
+    for (size_t i = 1; i != queues.size(); ++i) {
+      channel sibling(new channel::S(t, queues[i]));
+      sibling.self->_listener = new S::listener(sibling, cb, s, std::vector<queue>{queues[i]});
+      ch.self->_listener->siblings.push_back(sibling);
+      channel_listen_on_queue(sibling, ss, true);
+    }
+  }
+  channel_listen_on_queue(ch, ss, reuseport);
+  return ch;
+}
+
+
 struct close_job {
-  uv_connect_t  req;
+  channel       ch;
   fun<void()>   cb;
 };
 
 
 void channel::close(fun<void()> cb) const {
   self->_rctx.stop();
+  if (self->_timeouts.idle_timer != nullptr) {
+    self->_timeouts.idle_timer.cancel();
+    self->_timeouts.idle_timer = nullptr;
+  }
+
+  if (self->_listener != nullptr) {
+    for (const channel& sibling : self->_listener->siblings) {
+      sibling.self->_q.async([=]{ sibling.close(); });
+    }
+    self->_listener->siblings.clear();
+    self->_listener->ch = nullptr; // the caller holds a reference, so this doesn't deallocate
+    if (self->_stream == nullptr) {
+      // Never started listening, or failed to
+      if ((bool)cb) { cb(); }
+      return;
+    }
+  }
+
+  if (self->tls != nullptr && self->tls->is_initiated() &&
+      uv_is_writable(self->_stream) && !uv_is_closing((uv_handle_t*)self->_stream)) {
+    // Send close_notify. Besides telling the peer that nothing was truncated, a clean shutdown
+    // keeps the session resumable, as OpenSSL invalidates sessions of connections that weren't
+    // shut down. libuv writes right away when nothing is queued, before the handle is closed.
+    SSL_shutdown(self->tls->session);
+    tls_flush(self, nullptr);
+  }
 
   // Steal handle from channel
   assert(self->_stream != nullptr);
@@ -874,15 +2744,19 @@ void channel::close(fun<void()> cb) const {
   self->_stream = nullptr;
 
   // Issue `close`, eventually freeing the handle
-  close_job* job = new close_job;
+  close_job* job = record_new<close_job>();
+  job->ch = *this;
   job->cb = cb;
   handle->data = job;
 
   uv_close(handle, [](uv_handle_t* handle) {
     close_job* job = static_cast<close_job*>(handle->data);
-    // delete handle;
+    delete (uv_tcp_t*)handle;
+    // A read that was still active when the channel was closed holds a reference to the channel,
+    // which is let go of now that we're not inside of any read callback.
+    job->ch.self->_rctx.end();
     if ((bool)job->cb) { job->cb(); }
-    delete job;
+    record_delete(job);
   });
 }
 
@@ -904,6 +2778,105 @@ void channel::close(fun<void()> cb) const {
 // base and len members of the uv_buf_t struct. The user is responsible for
 // freeing base after the uv_buf_t is done. Return struct passed by value.
 
+// Decrypt and deliver all application data that can be produced from the TLS records received so
+// far, one chunk per record, until OpenSSL needs more input or the read ends.
+static void tls_read_drain(channel::S* self) {
+  channel::S::tls_session& tls = *self->tls;
+  while (self->_rctx.reading) {
+    size_t z = HI_MIN(self->_rctx.max_size, tls_max_record_size);
+    data d(data_alloc(z));
+    int n = SSL_read(tls.session, d->bytes(), static_cast<int>(z));
+    if (n > 0) {
+      d->set_size(static_cast<size_t>(n));
+      if (!self->_rctx.cb(nullptr, d)) {
+        self->_rctx.end();
+      }
+      continue;
+    }
+    switch (SSL_get_error(tls.session, n)) {
+      case SSL_ERROR_WANT_READ: {
+        // Nothing more to decrypt until more data arrives. Records without application data, like
+        // session tickets, end up here as well.
+        return;
+      }
+      case SSL_ERROR_ZERO_RETURN: {
+        // The peer sent close_notify, which is the TLS equivalent of EOF
+        self->_rctx.cb(nullptr, data());
+        self->_rctx.end();
+        return;
+      }
+      default: {
+        self->_rctx.cb(tls_error(), data());
+        self->_rctx.end();
+        return;
+      }
+    }
+  }
+}
+
+
+// Fail the active read once nothing has been received for the read timeout. The timer is checked
+// after `delay` and rescheduled if data has been received since it was scheduled.
+static void channel_schedule_read_timeout(channel::S* self, uint64_t delay) {
+  // The read holds a reference to the channel, and cancels the timer when it ends
+  self->_rctx.deadline = self->_q.after(delay / 1000000000.0, [self]{
+    if (self->_timeouts.read == 0) {
+      return; // the timeout was removed
+    }
+    uint64_t elapsed = uv_hrtime() - self->_timeouts.last_read;
+    if (elapsed < self->_timeouts.read) {
+      channel_schedule_read_timeout(self, self->_timeouts.read - elapsed);
+      return;
+    }
+    self->_rctx.cb(timeout_error("Read"), data());
+    self->_rctx.end();
+  });
+}
+
+
+// Close the channel once nothing has been read or written for the idle timeout. The timer holds a
+// reference to the channel, so an idle channel is closed even if nothing else refers to it.
+static void channel_schedule_idle_timeout(const channel& ch, uint64_t delay) {
+  ch.self->_timeouts.idle_timer = ch.self->_q.after(delay / 1000000000.0, [ch]{
+    channel::S* self = ch.self;
+    uint64_t last = HI_MAX(self->_timeouts.last_read, self->_timeouts.last_write);
+    uint64_t elapsed = uv_hrtime() - last;
+    if (self->_timeouts.idle == 0 || self->_stream == nullptr) {
+      self->_timeouts.idle_timer = nullptr;
+      return;
+    }
+    if (elapsed < self->_timeouts.idle) {
+      channel_schedule_idle_timeout(ch, self->_timeouts.idle - elapsed);
+      return;
+    }
+    if (self->_rctx.reading) {
+      self->_rctx.cb(timeout_error("Idle channel"), data());
+      self->_rctx.end();
+    }
+    if (self->_stream != nullptr) {
+      ch.close(); // also lets go of this timer
+    }
+  });
+}
+
+
+void channel::set_read_timeout(double seconds) const {
+  self->_timeouts.read = static_cast<uint64_t>(HI_MAX(seconds, 0.0) * 1000000000.0);
+}
+
+
+void channel::set_idle_timeout(double seconds) const {
+  assert(self->_q.is_current());
+  self->_timeouts.idle = static_cast<uint64_t>(HI_MAX(seconds, 0.0) * 1000000000.0);
+  if (self->_timeouts.idle != 0 && self->_timeouts.idle_timer == nullptr &&
+      self->_stream != nullptr) {
+    // Idle from now on
+    self->_timeouts.last_read = self->_timeouts.last_write = uv_hrtime();
+    channel_schedule_idle_timeout(*this, self->_timeouts.idle);
+  }
+}
+
+
 void channel::read(size_t max_size, channel_read_cb cb) const {
   assert(self->_rctx.active() == false);
   assert(self->_stream != 0);
@@ -911,6 +2884,10 @@ void channel::read(size_t max_size, channel_read_cb cb) const {
   assert(self->tls == nullptr || self->tls->is_initiated() == true);
 
   self->_rctx.begin(this, cb, max_size);
+  if (self->_timeouts.read != 0) {
+    self->_timeouts.last_read = uv_hrtime();
+    channel_schedule_read_timeout(self, self->_timeouts.read);
+  }
 
   int r = uv_read_start(self->_stream,
 
@@ -918,13 +2895,19 @@ void channel::read(size_t max_size, channel_read_cb cb) const {
     [](uv_handle_t *handle, size_t suggested_size) -> uv_buf_t {
       channel::S* self = static_cast<channel::S*>(handle->data);
       size_t size = HI_MIN(suggested_size, self->_rctx.max_size);
-      return uv_buf_init((char*)malloc(size), size); // TODO: Free list
-      // The callee is responsible for freeing the buffer, libuv does not reuse it.
+      // The callee is responsible for freeing the buffer, libuv does not reuse it. We hand out the
+      // bytes of a new data object and recover the object from the buffer in the read callback.
+      data::S* d = data_alloc(size);
+      return uv_buf_init(d->bytes, size);
     },
 
     // When data is ready to be read
     [](uv_stream_t* stream, ssize_t nread, uv_buf_t buf) {
       channel::S* self = static_cast<channel::S*>(stream->data);
+      data d;
+      if (buf.base != nullptr) {
+        d = data(data_from_bytes(buf.base)); // takes over the reference from the alloc callback
+      }
 
       // `nread` is > 0 if there is data available, 0 if libuv is done reading for now or -1 on
       // error.
@@ -959,26 +2942,15 @@ void channel::read(size_t max_size, channel_read_cb cb) const {
         default: {
           assert(nread > 0);
           // Note: `nread` might be less than `buf.len`
-          data d = create_data(buf.base, nread, buf.len);
+          d->set_size((size_t)nread);
+          self->_timeouts.last_read = uv_hrtime();
 
           if (self->tls != nullptr) {
-            // TLS is active - filter through BIO
-            int written = BIO_write(self->tls->in_bio, d->bytes(), d->size());
-            assert(written >= 0); // since its in memory-mode writing should never fail
-            // std::cout << "[read] BIO_write => " << written << "\n";
-            // Cause data in in_bio to be decoded and placed back into `d`
-            int nread2 = SSL_read(self->tls->session, d->bytes(), d->capacity());
-            // std::cout << "[read] SSL_read(*, " << d->capacity() << ") => " << nread2 << "\n";
-            if (nread2 < 0) {
-              self->_rctx.cb(tls_error(), d);
-              self->_rctx.end();
-              break;
-            } else if (nread2 == 0) {
-              // Can happen with TLS/SSL control data. Just ignore.
-              break;
-            } else {
-              d->set_size((size_t)nread2);
-            }
+            // TLS is active - decrypt the records in `d`. A single read might carry several
+            // records, and all of them are delivered before we go back to waiting for the socket.
+            self->tls->io.feed(std::move(d));
+            tls_read_drain(self);
+            break;
           }
 
           // Call read handler with data in `d`
@@ -996,48 +2968,120 @@ void channel::read(size_t max_size, channel_read_cb cb) const {
     // uv_read_start error
     self->_rctx.cb(loop_error(self->_stream->loop), data());
     self->_rctx.end();
+    return;
+  }
+
+  if (self->tls != nullptr &&
+      (SSL_pending(self->tls->session) > 0 || self->tls->io.in_size > 0)) {
+    // Records that arrived with the end of the handshake, or that were left when an earlier read
+    // ended, are delivered without waiting for the socket.
+    channel ch = *this;
+    self->_q.async([ch]{
+      if (ch.self->_rctx.reading && ch.self->tls != nullptr) {
+        tls_read_drain(ch.self);
+      }
+    });
   }
 }
 
 
+// Retains the buffers of a vectored write until libuv is done with them
+struct writev_job {
+  uv_write_t        req;
+  uv_loop_t*        loop;
+  fun<void(error)>  cb;
+  std::vector<data> bufs;
+  writev_job(uv_loop_t* l, fun<void(error)> f, std::vector<data>&& b)
+      : loop(l), cb(f), bufs(std::move(b)) { req.data = this; }
+};
+
+
+// Write `bufs` to the stream as they are, in a single vectored write
+static void channel_writev(channel::S* self, std::vector<data>&& bufs, fun<void(error)> cb) {
+  // libuv copies the uv_buf_t array, so it only needs to live for the duration of uv_write
+  uv_buf_t uvbufs_small[8];
+  std::vector<uv_buf_t> uvbufs_large;
+  uv_buf_t* uvbufs = uvbufs_small;
+  if (bufs.size() > HI_COUNTOF(uvbufs_small)) {
+    uvbufs_large.resize(bufs.size());
+    uvbufs = uvbufs_large.data();
+  }
+  for (size_t i = 0; i != bufs.size(); ++i) {
+    uvbufs[i] = uv_buf_init(bufs[i]->bytes(), bufs[i].size());
+  }
+
+  size_t nbufs = bufs.size();
+  writev_job* job = record_new<writev_job>(self->_stream->loop, cb, std::move(bufs));
+
+  int r = uv_write(&job->req, self->_stream, uvbufs, nbufs, [](uv_write_t* req, int status) {
+    writev_job* job = static_cast<writev_job*>(req->data);
+    if ((bool)job->cb) { job->cb((status == 0) ? nullptr : loop_error(job->loop)); }
+    channel_did_write(req);
+    record_delete(job);
+  });
+
+  if (r != 0) {
+    // uv_write error
+    record_delete(job);
+    if ((bool)cb) { cb(loop_error(self->_stream->loop)); }
+  } else {
+    channel_did_queue_write(self);
+  }
+}
+
+
+// Copy `len` bytes into a new data object
+static data copy_data(const char* bytes, size_t len) {
+  data d = create_data(len);
+  memcpy((void*)d->bytes(), (const void*)bytes, len);
+  d->set_size(len);
+  return d;
+}
+
+
 void channel::write(const char* bytes, size_t len, fun<void(error)> cb) const {
   assert(self->_stream != 0);
   assert(uv_is_closing((uv_handle_t*)self->_stream) == 0);
   assert(self->tls == nullptr || self->tls->is_initiated() == true);
 
-  static struct cb_ref_s { fun<void(error)> cb; } cb_ref;
+  if (self->_cork.depth != 0) {
+    self->_cork.append(copy_data(bytes, len), cb);
+    channel_did_queue_write(self);
+    return;
+  }
+
+  if (self->tls != nullptr) {
+    // TLS is active - filter through BIO and write the encrypted segments
+    TLS_TRACE
+    // SSL_write returns 0 for an empty write, which has nothing to encrypt anyway
+    if (len != 0 && SSL_write(self->tls->session, bytes, len) <= 0) {
+      if ((bool)cb) { cb(tls_error()); }
+      return;
+    }
+    tls_flush(self, cb);
+    return;
+  }
 
   struct job_s {
     fun<void(error)>  cb;
     uv_write_t        req;
     uv_loop_t*        loop;
+    size_t            bufsize;
     char              buf[];
-    void free() { cb = nullptr; ::free((void*)this); }
+    void free() {
+      size_t z = sizeof(job_s) + bufsize;
+      this->~job_s();
+      record_free((void*)this, z);
+    }
     static job_s* create(size_t bufsize) {
-      job_s* job = (job_s*)malloc(sizeof(job_s) + bufsize);
-      memcpy((void*)job, (const void*)&cb_ref, sizeof(cb_ref_s)); // init `cb`
+      job_s* job = new (record_alloc(sizeof(job_s) + bufsize)) job_s;
+      job->bufsize = bufsize;
       return job;
     }
-  }* job = nullptr;
+  };
 
-  if (self->tls != nullptr) {
-    // TLS is active - filter through BIO
-    TLS_TRACE
-    int r = SSL_write(self->tls->session, bytes, len);
-    if (r < 0) {
-      if ((bool)cb) { cb(tls_error()); }
-      return;
-    }
-    BIO* out_bio = self->tls->out_bio;
-    len = BIO_pending(out_bio);
-    job = job_s::create(len);
-    int nread = BIO_read(out_bio, job->buf, len);
-    assert(nread >= 0); // since out_bio is in memory-mode, reading should never fail
-    len = static_cast<size_t>(nread);
-  } else {
-    job = job_s::create(len);
-    memcpy((void*)job->buf, (const void*)bytes, len);
-  }
+  job_s* job = job_s::create(len);
+  memcpy((void*)job->buf, (const void*)bytes, len);
 
   job->loop = self->_stream->loop;
   job->cb = cb;
@@ -1048,12 +3092,15 @@ void channel::write(const char* bytes, size_t len, fun<void(error)> cb) const {
   int r = uv_write(&job->req, self->_stream, &uvbuf, 1, [](uv_write_t* req, int status) {
     job_s* job = static_cast<job_s*>(req->data);
     if ((bool)job->cb) { job->cb((status == 0) ? nullptr : loop_error(job->loop)); }
+    channel_did_write(req);
     job->free();
   });
 
   if (r != 0) {
     if ((bool)cb) { cb(loop_error(self->_stream->loop)); }
     job->free();
+  } else {
+    channel_did_queue_write(self);
   }
 }
 
@@ -1063,47 +3110,33 @@ void channel::write(char* bytes, size_t len, size_t capacity, fun<void(error)> c
   assert(uv_is_closing((uv_handle_t*)self->_stream) == 0);
   assert(self->tls == nullptr || self->tls->is_initiated() == true);
 
-  struct job_s {
-    uv_write_t        req;
-    uv_loop_t*        loop;
-    fun<void(error)>  cb;
-    char*             spill_buf = nullptr;
-    job_s(uv_loop_t* l, fun<void(error)> f, char* sb) : loop(l), cb(f), spill_buf(sb) {
-      req.data = this; }
-    ~job_s() { if (spill_buf != nullptr) { delete[] spill_buf; } }
-  }* job = nullptr;
-
+  if (self->_cork.depth != 0) {
+    // `bytes` is managed by the caller, so buffer a copy
+    self->_cork.append(copy_data(bytes, len), cb);
+    channel_did_queue_write(self);
+    return;
+  }
 
   if (self->tls != nullptr) {
     TLS_TRACE
-    // TLS is active - filter through BIO
-    int r = SSL_write(self->tls->session, bytes, len);
-    if (r < 0) {
+    // TLS is active - filter through BIO and write the encrypted segments. `bytes` is not needed
+    // after SSL_write, but `cb` is still called once the encrypted bytes have been written.
+    if (len != 0 && SSL_write(self->tls->session, bytes, len) <= 0) {
       cb(tls_error());
       return;
     }
-
-    TLS_TRACE
-    BIO* out_bio = self->tls->out_bio;
-    size_t npending = BIO_pending(out_bio);
-
-    if (npending > capacity) {
-      TLS_TRACE
-      // there's more data to be sent than we have room for in `bytes`
-      capacity = npending;
-      bytes = new char[capacity];
-      job = new job_s(self->_stream->loop, cb, bytes);
-    }
-
-    int nread = BIO_read(out_bio, bytes, capacity);
-    assert(nread >= 0); // since out_bio is in memory-mode, reading should never fail
-    len = static_cast<size_t>(nread);
+    tls_flush(self, cb);
+    return;
   }
 
+  struct job_s {
+    uv_write_t        req;
+    uv_loop_t*        loop;
+    fun<void(error)>  cb;
+    job_s(uv_loop_t* l, fun<void(error)> f) : loop(l), cb(f) { req.data = this; }
+  };
 
-  if (job == nullptr) {
-    job = new job_s(self->_stream->loop, cb, nullptr);
-  }
+  job_s* job = record_new<job_s>(self->_stream->loop, cb);
 
   uv_buf_t uvbufs[] = {{ .base = bytes, .len = len }};
 
@@ -1111,58 +3144,447 @@ void channel::write(char* bytes, size_t len, size_t capacity, fun<void(error)> c
     [](uv_write_t* req, int status) {
       job_s* job = static_cast<job_s*>(req->data);
       job->cb((status == 0) ? nullptr : loop_error(job->loop));
-      delete job;
+      channel_did_write(req);
+      record_delete(job);
     }
   );
 
   if (r != 0) {
     // uv_write error
-    delete job;
+    record_delete(job);
     cb(loop_error(self->_stream->loop));
+  } else {
+    channel_did_queue_write(self);
   }
 }
 
 
+// Retains the buffer of a write until libuv is done with it
+struct data_write_job {
+  uv_write_t        req;
+  uv_loop_t*        loop;
+  fun<void(error)>  cb;
+  data              buf;
+  data_write_job(uv_loop_t* l, fun<void(error)> f, const data& d) : loop(l), cb(f), buf(d) {
+    req.data = this; }
+};
+
+
+void channel::write(data buf, fun<void(error)> cb) const {
+  assert(self->_stream != 0);
+  assert(uv_is_closing((uv_handle_t*)self->_stream) == 0);
+  assert(self->tls == nullptr || self->tls->is_initiated() == true);
+
+  if (self->_cork.depth != 0) {
+    self->_cork.append(std::move(buf), cb);
+    channel_did_queue_write(self);
+    return;
+  }
+
+  if (self->tls != nullptr) {
+    // The plaintext has to be encrypted into a new buffer anyway
+    std::vector<data> bufs;
+    bufs.emplace_back(std::move(buf));
+    write(std::move(bufs), cb);
+    return;
+  }
+
+  data_write_job* job = record_new<data_write_job>(self->_stream->loop, cb, buf);
+  uv_buf_t uvbuf = uv_buf_init(buf->bytes(), buf.size());
+
+  int r = uv_write(&job->req, self->_stream, &uvbuf, 1, [](uv_write_t* req, int status) {
+    data_write_job* job = static_cast<data_write_job*>(req->data);
+    if ((bool)job->cb) { job->cb((status == 0) ? nullptr : loop_error(job->loop)); }
+    channel_did_write(req);
+    record_delete(job);
+  });
+
+  if (r != 0) {
+    // uv_write error
+    record_delete(job);
+    if ((bool)cb) { cb(loop_error(self->_stream->loop)); }
+  } else {
+    channel_did_queue_write(self);
+  }
+}
+
+
+void channel::write(std::vector<data> bufs, fun<void(error)> cb) const {
+  assert(self->_stream != 0);
+  assert(uv_is_closing((uv_handle_t*)self->_stream) == 0);
+  assert(self->tls == nullptr || self->tls->is_initiated() == true);
+
+  if (self->_cork.depth != 0) {
+    for (data& d : bufs) {
+      self->_cork.append(std::move(d), nullptr);
+    }
+    if ((bool)cb) { self->_cork.cbs.push_back(cb); }
+    channel_did_queue_write(self);
+    return;
+  }
+
+  if (self->tls != nullptr) {
+    // TLS is active - filter through BIO and write the encrypted segments. Small buffers are
+    // gathered so that they share records, rather than each costing a record of its own.
+    TLS_TRACE
+    SSL* session = self->tls->session;
+    data gathered;
+    for (const data& d : bufs) {
+      bool direct = d.size() >= tls_max_record_size / 2; // not worth copying
+      if (gathered != nullptr && (direct || gathered.size() + d.size() > gathered.capacity())) {
+        if (SSL_write(session, gathered.bytes(), gathered.size()) <= 0) {
+          if ((bool)cb) { cb(tls_error()); }
+          return;
+        }
+        gathered = nullptr;
+      }
+      if (direct) {
+        if (SSL_write(session, d.bytes(), d.size()) <= 0) {
+          if ((bool)cb) { cb(tls_error()); }
+          return;
+        }
+      } else if (d.size() != 0) {
+        if (gathered == nullptr) {
+          gathered = create_data(tls_write_segment_size);
+        }
+        memcpy(gathered->bytes() + gathered.size(), d.bytes(), d.size());
+        gathered->set_size(gathered.size() + d.size());
+      }
+    }
+    if (gathered != nullptr && SSL_write(session, gathered.bytes(), gathered.size()) <= 0) {
+      if ((bool)cb) { cb(tls_error()); }
+      return;
+    }
+    tls_flush(self, cb);
+    return;
+  }
+
+  channel_writev(self, std::move(bufs), cb);
+}
+
+
+size_t channel::write_queue_size() const {
+  return self->write_queue_size();
+}
+
+
+void channel::set_write_watermarks(size_t high, size_t low, fun<void()> on_drain) const {
+  assert(low <= high);
+  self->_wm.high = high;
+  self->_wm.low = low;
+  self->_wm.on_drain = on_drain;
+  self->_wm.full = false;
+  channel_did_queue_write(self);
+}
+
+
+bool channel::write_queue_full() const {
+  return self->_wm.full;
+}
+
+
+void channel::cork() const {
+  ++self->_cork.depth;
+}
+
+
+void channel::uncork() const {
+  assert(self->_cork.depth != 0);
+  if (--self->_cork.depth != 0 || (self->_cork.bufs.empty() && self->_cork.cbs.empty())) {
+    return;
+  }
+  std::vector<data> bufs;
+  std::vector<fun<void(error)>> cbs;
+  std::swap(bufs, self->_cork.bufs);
+  std::swap(cbs, self->_cork.cbs);
+  self->_cork.nbytes = 0;
+  if (bufs.empty()) {
+    // Only empty writes were made while corked
+    self->_q.async([cbs]{
+      for (const fun<void(error)>& cb : cbs) { cb(nullptr); }
+    });
+  } else if (cbs.empty()) {
+    write(std::move(bufs));
+  } else if (cbs.size() == 1) {
+    write(std::move(bufs), std::move(cbs[0]));
+  } else {
+    write(std::move(bufs), [cbs](error err) {
+      for (const fun<void(error)>& cb : cbs) { cb(err); }
+    });
+  }
+}
+
+
+// ------------------------------------------------------------------------------------------------
+//                                          channel_pool
+// ------------------------------------------------------------------------------------------------
+#pragma mark - channel_pool
+
+struct channel_pool::S : ref_counted {
+  struct idle_channel {
+    channel   ch;
+    uint64_t  since; // uv_hrtime
+  };
+
+  // Channels connected to one endpoint with one TLS context
+  struct endpoint {
+    std::string                     uri;
+    tls_context                     tls;
+    std::vector<idle_channel>       idle;     // most recently released last
+    std::deque<channel_connect_cb>  waiters;  // acquires waiting for a channel
+    size_t                          nopen = 0; // idle, in use and connecting
+  };
+
+  queue                                     q;
+  size_t                                    max_per_endpoint;
+  uint64_t                                  idle_timeout;
+  std::unordered_map<std::string,endpoint>  endpoints;
+  std::unordered_map<channel::S*,endpoint*> owners;  // endpoint of each channel handed out
+  timer                                     sweep;   // closes idle channels that timed out
+
+  S(queue q_, size_t m, double t)
+    : q(q_), max_per_endpoint(m), idle_timeout(static_cast<uint64_t>(t * 1000000000.0)) {}
+
+  endpoint& endpoint_for(const std::string& uri, const tls_context& tls) {
+    std::string key = uri;
+    if (tls != nullptr) {
+      key += '#' + std::to_string((uintptr_t)tls.self);
+    }
+    endpoint& e = endpoints[key];
+    if (e.uri.empty()) {
+      e.uri = uri;
+      e.tls = tls;
+    }
+    return e;
+  }
+
+  void connect(endpoint& e, channel_connect_cb cb) {
+    ++e.nopen;
+    channel_pool pool(this, /*addRef=*/true);
+    channel::connect(q, e.uri, e.tls, [pool, &e, cb](error err, channel ch) {
+      if (err != nullptr) {
+        pool.self->close_one(e);
+        cb(err, nullptr);
+      } else {
+        pool.self->owners[ch.self] = &e;
+        cb(nullptr, ch);
+      }
+    });
+  }
+
+  // Account for a channel of `e` having been closed, which makes room for a waiting acquire
+  void close_one(endpoint& e) {
+    assert(e.nopen != 0);
+    --e.nopen;
+    if (!e.waiters.empty() && e.nopen < max_per_endpoint) {
+      channel_connect_cb cb = std::move(e.waiters.front());
+      e.waiters.pop_front();
+      connect(e, cb);
+    }
+  }
+
+  // Stop watching an idle channel and take it out of `e.idle`
+  channel take_idle(endpoint& e, size_t i) {
+    channel ch = std::move(e.idle[i].ch);
+    e.idle.erase(e.idle.begin() + i);
+    ch.self->_rctx.end();
+    return ch;
+  }
+
+  void close(endpoint& e, channel ch) {
+    owners.erase(ch.self);
+    ch.close();
+    close_one(e);
+  }
+
+  // While idle, a channel is read from. Any data or EOF means that the channel is no longer usable,
+  // e.g. because the server has closed it, so it's closed and dropped from the pool.
+  void watch_idle(const channel& ch) {
+    S* self = this; // the pool closes its idle channels before it goes away
+    ch.read(1, [self, ch](error err, data d) {
+      // The read ends when we return, so leave ending it to the channel
+      channel c = ch;
+      endpoint& e = *self->owners[c.self];
+      for (size_t i = 0; i != e.idle.size(); ++i) {
+        if (e.idle[i].ch == c) {
+          e.idle.erase(e.idle.begin() + i);
+          self->close(e, c);
+          break;
+        }
+      }
+      return false;
+    });
+  }
+
+  // Close idle channels that timed out, and schedule the next sweep for when the channel which has
+  // been idle the longest times out
+  void close_timed_out() {
+    uint64_t now = uv_hrtime();
+    uint64_t oldest = UINT64_MAX;
+    for (auto& it : endpoints) {
+      endpoint& e = it.second;
+      // Least recently released first
+      while (!e.idle.empty() && now - e.idle.front().since >= idle_timeout) {
+        close(e, take_idle(e, 0));
+      }
+      if (!e.idle.empty()) {
+        oldest = HI_MIN(oldest, e.idle.front().since);
+      }
+    }
+    sweep = nullptr;
+    if (oldest != UINT64_MAX) {
+      schedule_sweep(oldest + idle_timeout - now);
+    }
+  }
+
+  void schedule_sweep(uint64_t delay) {
+    S* self = this; // the pool cancels the sweep before it goes away
+    sweep = q.after(delay / 1000000000.0, [self]{ self->close_timed_out(); });
+  }
+};
+
+
+channel_pool::channel_pool(queue q, size_t max_per_endpoint, double idle_timeout)
+  : channel_pool(new S(q, max_per_endpoint, idle_timeout)) {
+  assert(max_per_endpoint != 0);
+}
+
+
+void channel_pool::dealloc(S* self) {
+  assert(self->q.is_current());
+  for (auto& it : self->endpoints) {
+    S::endpoint& e = it.second;
+    while (!e.idle.empty()) {
+      channel ch = self->take_idle(e, e.idle.size() - 1);
+      ch.close();
+    }
+  }
+  if (self->sweep != nullptr) {
+    self->sweep.cancel();
+  }
+  delete self;
+}
+
+
+void channel_pool::acquire(const std::string& endpoint, channel_connect_cb cb) const {
+  acquire(endpoint, nullptr, cb);
+}
+
+
+void channel_pool::acquire(const std::string& endpoint, tls_context tls,
+                           channel_connect_cb cb) const {
+  assert(self->q.is_current());
+  S::endpoint& e = self->endpoint_for(endpoint, tls);
+  if (!e.idle.empty()) {
+    // Most recently released first, as it's the least likely to have been closed by the peer
+    channel ch = self->take_idle(e, e.idle.size() - 1);
+    cb(nullptr, ch);
+  } else if (e.nopen < self->max_per_endpoint) {
+    self->connect(e, cb);
+  } else {
+    e.waiters.push_back(cb);
+  }
+}
+
+
+void channel_pool::release(channel ch) const {
+  assert(self->q.is_current());
+  if (ch.self->_rctx.active()) {
+    // Released from a read callback, which is expected to end the read by returning false. The
+    // channel is passed on once that has happened.
+    channel_pool pool = *this;
+    self->q.async([pool, ch]{
+      assert(ch.self->_rctx.active() == false);
+      pool.release(ch);
+    });
+    return;
+  }
+  auto it = self->owners.find(ch.self);
+  assert(it != self->owners.end()); // not from this pool
+  S::endpoint& e = *it->second;
+  if (!e.waiters.empty()) {
+    // Hand over directly
+    channel_connect_cb cb = std::move(e.waiters.front());
+    e.waiters.pop_front();
+    cb(nullptr, ch);
+    return;
+  }
+  e.idle.push_back(S::idle_channel{ch, uv_hrtime()});
+  self->watch_idle(ch);
+  if (self->sweep == nullptr) {
+    self->schedule_sweep(self->idle_timeout);
+  }
+}
+
+
+void channel_pool::discard(channel ch) const {
+  assert(self->q.is_current());
+  auto it = self->owners.find(ch.self);
+  assert(it != self->owners.end()); // not from this pool
+  self->close(*it->second, ch);
+}
+
+
+size_t channel_pool::idle_count() const {
+  size_t n = 0;
+  for (auto& it : self->endpoints) {
+    n += it.second.idle.size();
+  }
+  return n;
+}
+
+
 // ------------------------------------------------------------------------------------------------
 //                                             data
 // ------------------------------------------------------------------------------------------------
 #pragma mark - data
 
-// struct data_free_list_ {
-//   std::stack<data> stack;
-//   size_t           sum_size;
-// } data_free_list;
+data create_data(size_t capacity) {
+  return data(data_alloc(capacity));
+}
+
 
 data create_data(char* buffer, size_t size, size_t capacity) {
-  // if (q->data_pool.empty()) {
-  #if 0
-  data d = std::make_shared<data_>(size, buffer);
-  std::cout << "*data '" << std::string((const char*)buffer, size) << "' @" << (void*)d.get() << "\n";
-  return d;
-  #else
-  return std::make_shared<data_>(buffer, size, capacity);
-  #endif
-  // } else {
-  //   data d = q->data_pool.front();
-  //   q->data_pool.pop_front();
-  //   q->data_pool.sum_size -= d.size();
-  //   return d
-  // }
-}
-
-
-data_::~data_() {
-  // static const size_t BYTE_SIZE_LIMIT = 100;
-  // size_t new_sum_size = q->data_free_list.sum_size + _size;
-  // if (new_sum_size <= BYTE_SIZE_LIMIT) {
-  //   q->data_pool.sum_size += d.size();
-  //   q->push_front()
-  // }
-  if (_bytes != 0) {
-    // std::cout << "~data '" << std::string((const char*)_bytes, _size) << "' @" << (void*)this << "\n";
-    ::free((void*)_bytes);
-  }
-  // else { std::cerr << "~data @ '' " << (void*)this << "\n"; }
+  data::S* d = new (record_alloc(sizeof(data::S))) data::S;
+  d->bytes = buffer;
+  d->size = size;
+  d->capacity = capacity;
+  d->parent = nullptr;
+  d->owns_bytes = true;
+  return data(d);
+}
+
+
+data data::slice(size_t offset, size_t length) const {
+  assert(offset + length <= self->size);
+  S* owner = (self->parent != nullptr) ? self->parent : self;
+  __retain(owner);
+  S* d = new (record_alloc(sizeof(S))) S;
+  d->bytes = self->bytes + offset;
+  d->size = length;
+  d->capacity = length;
+  d->parent = owner;
+  d->owns_bytes = false;
+  return data(d);
+}
+
+
+void data::dealloc(S* self) {
+  if (self->parent != nullptr) {
+    __release(self->parent);
+    self->~S();
+    record_free((void*)self, sizeof(S));
+  } else if (self->owns_bytes) {
+    // Returns the buffer to the calling queue's buffer pool if it's of a pooled size
+    buffer_free(self->bytes, self->capacity);
+    self->~S();
+    record_free((void*)self, sizeof(S));
+  } else {
+    // Header and bytes were allocated together by data_alloc
+    size_t z = sizeof(S) + self->capacity;
+    self->~S();
+    buffer_free((char*)self, z);
+  }
 }
 
 
@@ -7,9 +7,12 @@ namespace hi {
 
 struct error;
 struct queue;
+struct timer;
+struct concurrent_queue;
 struct channel;
+struct channel_pool;
 struct tls_context;
-struct data_; typedef ::std::shared_ptr<data_> data;
+struct data;
 template <typename T> using fun = ::std::function<T>;
 
 // Call a function exactly and only once per once_flag object
@@ -23,24 +26,83 @@ bool  main_next();  // Run events in the main queue. Blocks if the queue is empt
                     // there are more events waiting to be processed.
 bool  main_next_nowait(); // Does not block in the case there are no queued events
 
-// Execute a function in some background thread
+// Quality of service classes of queues and tasks, from least to most latency-critical. Threads
+// doing work of a class are scheduled accordingly: on Linux `background` threads run with the
+// SCHED_IDLE policy, `utility` threads with SCHED_BATCH and nice 10, and `interactive` threads with
+// nice -10 if the process is allowed to raise its priority. On Darwin they map onto the QoS class
+// of the same name. Threads can't take back a priority they have given up, so a thread's class is
+// set when it starts.
+enum class qos { background, utility, normal, interactive };
+
+// Execute a function in some background thread. Each QoS class has its own set of threads.
 void async(fun<void()>);
+void async(qos, fun<void()>);
 
-// Suspend the calling queue for `seconds` time. Returns true if interrupted.
+// Suspend the calling queue for `seconds` time. Returns true if interrupted. This blocks the
+// queue's thread; use queue::after to run something later without blocking.
 bool sleep(double seconds);
 
-// Serial processing queue
+// Suspend the calling queue's block for `seconds` time and continue with `fn` on that queue. The
+// queue runs other blocks meanwhile. Without a calling queue, e.g. in a function passed to
+// hi::async, this blocks like sleep(seconds) and then calls `fn`.
+void sleep(double seconds, fun<void()> fn);
+
+// Serial processing queue. The queue's thread runs with the scheduling priority of `qos`.
 struct queue {
-  queue(const std::string& label);
+  queue(const std::string& label, qos = qos::normal);
   // static queue current();
   queue& resume() const;
   queue& async(fun<void()>) const;
   bool is_current() const; // true if this is the calling queue
   const std::string& label() const;
+
+  // Run a function on the queue once after `seconds`, or every `seconds` until the returned timer
+  // is cancelled. Repeating timers skip runs they have fallen behind on. Timers keep the queue
+  // and its run loop alive until they have fired or been cancelled.
+  timer after(double seconds, fun<void()>) const;
+  timer every(double seconds, fun<void()>) const;
+
+  // Statistics for the allocator that recycles internal records (blocks, I/O jobs) on the queue.
+  // A hit is an allocation served from the queue's free lists, a miss one that went to malloc.
+  struct alloc_stats { uint64_t hits; uint64_t misses; };
+  alloc_stats slab_stats() const;
+
+  // Read buffers are recycled through a per-queue pool. `buffer_stats` reports hits and misses for
+  // buffer allocations and `set_buffer_pool_limit` caps the number of bytes held by the pool
+  // (default 1 MB).
+  alloc_stats buffer_stats() const;
+  void set_buffer_pool_limit(size_t bytes) const;
+
   queue() : self(nullptr) {};
   HI_REF_MIXIN(queue)
 };
 
+// A function scheduled by queue::after or queue::every
+struct timer {
+  // The function won't be called after this returns, unless it's already running on the queue.
+  // Can be called from any thread, including from the function itself.
+  void cancel() const;
+  timer() : self(nullptr) {};
+  HI_REF_MIXIN(timer)
+};
+
+// Concurrent processing queue. Blocks are run in parallel on `width` threads, without any ordering
+// guarantees between blocks. A `width` of 0 means "one thread per CPU core". The threads run with
+// the scheduling priority of `qos`. Blocks can be given a QoS class of their own, in which case
+// blocks waiting to run are started in order of their class, most latency-critical first. Blocks
+// of a class lower than the queue's don't make its threads give up priority.
+struct concurrent_queue {
+  concurrent_queue(const std::string& label, size_t width = 0, qos = qos::normal);
+  concurrent_queue& resume() const;
+  concurrent_queue& async(fun<void()>) const;
+  concurrent_queue& async(qos, fun<void()>) const;
+  bool is_current() const; // true if called from one of this queue's threads
+  const std::string& label() const;
+  size_t width() const;
+  concurrent_queue() : self(nullptr) {};
+  HI_REF_MIXIN(concurrent_queue)
+};
+
 struct semaphore {
   semaphore(unsigned int value = 0);
   
@@ -48,32 +110,109 @@ struct semaphore {
   // executing wait() is blocked, i.e., added to the semaphore's waiting queue.
   void wait() const;
 
+  // Like wait(), but rather than blocking the thread, the calling queue's block is suspended and
+  // continues with `fn` on that queue once the semaphore has been acquired. The queue runs other
+  // blocks meanwhile. `fn` is called right away if the semaphore can be acquired immediately.
+  void wait(fun<void()> fn) const;
+
   // Increments the value of semaphore variable by 1. After the increment, if the pre-increment
   // value was negative (meaning there are queues waiting), it transfers a blocked queue from the
-  // semaphore's waiting queue to the ready queue.
+  // semaphore's waiting queue to the ready queue. Waiters are woken in the order they waited.
   void signal() const;
 
   HI_REF_MIXIN(semaphore)
 };
 
+// Host name lookups made by channel::connect are cached per process. Successful lookups are reused
+// for `ttl` seconds (default 60) and failed ones for `negative_ttl` seconds (default 5).
+void set_dns_cache_ttl(double ttl, double negative_ttl);
+void clear_dns_cache();
+
 struct channel {
   static channel connect(const std::string& endpoint, fun<void(error,channel)>);
   static channel connect(const std::string& endpoint, tls_context, fun<void(error,channel)>);
   static channel connect(queue, const std::string& endpoint, fun<void(error,channel)>);
   static channel connect(queue, const std::string& endpoint, tls_context, fun<void(error,channel)>);
+
+  // Connect, failing with a timed_out() error if the connection, including the TLS handshake, isn't
+  // established within `timeout` seconds. A `timeout` of 0 means no timeout.
+  static channel connect(queue, const std::string& endpoint, tls_context, double timeout,
+                         fun<void(error,channel)>);
+
+  // Listen for connections on `endpoint`, e.g. "tcp:0.0.0.0:1337" or "tcp:[::]:1337". The
+  // callback receives each accepted channel, on the queue that channel belongs to. Given several
+  // queues, accepted channels are spread across them. Returns the listening channel, which keeps
+  // listening until it's closed. With a tls_context, the callback is called once the TLS
+  // handshake has completed, or failed.
+  static channel listen(const std::string& endpoint, fun<void(error,channel)>);
+  static channel listen(const std::string& endpoint, tls_context, fun<void(error,channel)>);
+  static channel listen(queue, const std::string& endpoint, fun<void(error,channel)>);
+  static channel listen(queue, const std::string& endpoint, tls_context, fun<void(error,channel)>);
+  static channel listen(const std::vector<queue>&, const std::string& endpoint,
+                        fun<void(error,channel)>);
+  static channel listen(const std::vector<queue>&, const std::string& endpoint, tls_context,
+                        fun<void(error,channel)>);
   std::string endpoint_name() const;
   tls_context tls() const; // == nullptr unless TLS-filtered
+  bool tls_session_reused() const; // true if the TLS handshake resumed an earlier session
   void close(fun<void()> = nullptr) const;
   void read(size_t max_size, fun<bool(error,data)>) const;
   void write(const char* buf, size_t len, fun<void(error)> = nullptr) const; // buf copy
   void write(char* buf, size_t len, size_t capacity, fun<void(error)>) const; // user buf mgmt.
+  void write(data buf, fun<void(error)> = nullptr) const; // retains `buf` until written, no copy
+  void write(std::vector<data> bufs, fun<void(error)> = nullptr) const; // scatter-gather, no copy
+
+  // Timeouts in seconds, 0 meaning none (the default). A read that receives nothing for the read
+  // timeout ends with a timed_out() error; the timeout applies to reads started after it's set.
+  // A channel on which nothing has been received or written for the idle timeout is closed, ending
+  // any read with a timed_out() error. The idle timeout must be set on the channel's queue.
+  void set_read_timeout(double seconds) const;
+  void set_idle_timeout(double seconds) const;
+
+  // While corked, writes are buffered instead of being sent. When the last cork() is balanced by
+  // uncork(), everything buffered is sent as a single vectored write and the callbacks of all the
+  // buffered writes are called when that write completes.
+  void cork() const;
+  void uncork() const;
+
+  // Number of bytes waiting to be written, including corked writes
+  size_t write_queue_size() const;
+
+  // Write flow control. Once write_queue_size() reaches `high` bytes, write_queue_full() returns
+  // true until the queue has drained to `low` bytes, at which point `on_drain` is called. Writes
+  // are never refused; producers are expected to stop writing while the queue is full.
+  void set_write_watermarks(size_t high, size_t low, fun<void()> on_drain) const;
+  bool write_queue_full() const;
   channel(); // == nullptr
   HI_REF_MIXIN(channel)
 };
 
+// Pool of connected channels for reuse, per endpoint and TLS context. acquire() hands out an idle
+// channel from the pool, or connects a new one. At most `max_per_endpoint` channels are open per
+// endpoint; beyond that, acquire() waits for a channel to be released or discarded. Channels are
+// given back with release() once done with, or discard() if they're no longer usable. A channel
+// released from one of its read callbacks is returned to the pool after that read has ended. Idle
+// channels are closed after `idle_timeout` seconds, or as soon as the peer closes them or sends
+// anything. A pool belongs to a queue, and must only be used and deallocated on that queue.
+struct channel_pool {
+  channel_pool(queue, size_t max_per_endpoint = 8, double idle_timeout = 30);
+  void acquire(const std::string& endpoint, fun<void(error,channel)>) const;
+  void acquire(const std::string& endpoint, tls_context, fun<void(error,channel)>) const;
+  void release(channel) const;
+  void discard(channel) const;
+  size_t idle_count() const;
+  channel_pool() : self(nullptr) {};
+  HI_REF_MIXIN(channel_pool)
+};
+
+// Configuration and session state shared by TLS channels. Files are in PEM format. Servers need a
+// certificate and a private key. Sessions are resumed when possible: servers cache sessions and
+// issue session tickets, and clients offer the last session of an endpoint when reconnecting.
 struct tls_context {
   tls_context();
-  void load_ca_cert_file(const char* path);
+  error load_ca_cert_file(const char* path);     // CAs trusted for verifying peers
+  error load_cert_file(const char* path);        // certificate chain presented to peers
+  error load_private_key_file(const char* path); // private key of the certificate
   HI_REF_MIXIN(tls_context)
 };
 
@@ -83,34 +222,55 @@ struct error {
   error() : self(nullptr) {} // == nullptr
   int code() const;
   const std::string& message() const;
+  bool timed_out() const; // true if an operation failed because it timed out
   HI_REF_MIXIN(error)
 };
 
-data create_data(char* bytes, size_t size, size_t capacity); // takes ownership over `bytes`
-
-struct data_ {
-  const char* bytes() const { return _bytes; }
-  char* bytes() { return _bytes; }
-  size_t size() const { return _size; }
-  void set_size(size_t z) { assert(z <= _capacity); _size = z; }
-  size_t capacity() const { return _capacity; }
-  ~data_();
-  data_(char* b, size_t z, size_t c) : _bytes(b), _size(z), _capacity(c) {}
-  char*  _bytes;
-  size_t _size;
-  size_t _capacity;
+// Reference-counted byte buffer. A data created with `create_data(capacity)` keeps its header,
+// reference count and bytes in a single allocation. Slices share the bytes of the data they were
+// created from, keeping it alive for as long as the slice exists.
+struct data {
+  const char* bytes() const;
+  char* bytes();
+  size_t size() const;
+  void set_size(size_t z);
+  size_t capacity() const;
+  data slice(size_t offset, size_t length) const; // no copy
+  data() : self(nullptr) {} // == nullptr
+  HI_REF_MIXIN(data)
 };
 
+data create_data(size_t capacity); // new buffer of `capacity` bytes, with size() == 0
+data create_data(char* bytes, size_t size, size_t capacity); // takes ownership over `bytes`
+
 inline std::ostream& operator<< (std::ostream& os, const error& e) {
   return (e == nullptr) ? (os << "(null)") : (os << e.message() << " #" << e.code());
 }
 
 // ------------------------------------------------------------------------------------------------
 
+// The data header is public so that its accessors can be inlined
+struct data::S : ref_counted {
+  char*  bytes;
+  size_t size;
+  size_t capacity;
+  S*     parent;     // data owning the bytes when this is a slice, otherwise nullptr
+  bool   owns_bytes; // `bytes` is a separately allocated buffer owned by this data
+};
+inline const char* data::bytes() const { return self->bytes; }
+inline char* data::bytes() { return self->bytes; }
+inline size_t data::size() const { return self->size; }
+inline void data::set_size(size_t z) { assert(z <= self->capacity); self->size = z; }
+inline size_t data::capacity() const { return self->capacity; }
+
 struct once_flag { volatile long s = 0; };
 template<class Function, typename... Args>
 inline void once(once_flag& pred, Function&& f, Args&&... args) {
-  if (hi_atomic_cas(&pred.s, 0, 1) == 0) { f(args...); }
+  // Checked with a plain load first, so that later calls don't need a locked read-modify-write
+  if (hi_atomic_load(&pred.s, HI_ATOMIC_ACQUIRE) == 0 &&
+      hi_atomic_cas_bool_explicit(&pred.s, 0L, 1L, HI_ATOMIC_ACQ_REL)) {
+    f(args...);
+  }
 }
 
 } // namespace
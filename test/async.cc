@@ -16,6 +16,34 @@ int main(int argc, char** argv) {
     sem1.wait();
   }
   assert_eq(count, N);
+
+  // Tasks submitted from within a task go to the submitting worker's own deque and can be stolen
+  // by other workers
+  count = 0;
+  for (int i = 0; i != N; ++i) {
+    hi::async([&]{
+      hi::async([&]{ hi_atomic_add32(&count, 1); sem1.signal(); });
+      hi_atomic_add32(&count, 1);
+      sem1.signal();
+    });
+  }
+  for (int i = 0; i != N*2; ++i) {
+    sem1.wait();
+  }
+  assert_eq(count, N*2);
+
+  // The pool of a class is started by whichever task first submits to it, with the others waiting
+  // for it to be started
+  count = 0;
+  for (int i = 0; i != N; ++i) {
+    hi::async([&]{
+      hi::async(qos::utility, [&]{ hi_atomic_add32(&count, 1); sem1.signal(); });
+    });
+  }
+  for (int i = 0; i != N; ++i) {
+    sem1.wait();
+  }
+  assert_eq(count, N);
   #if !HI_TEST_SUIT_RUNNING
   ru.delta_dumpn(N, "");
   #endif
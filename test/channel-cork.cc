@@ -0,0 +1,78 @@
+#include "test.h"
+#include <hi/hi.h>
+
+using namespace hi;
+
+// Writes made while a channel is corked are buffered and sent together once it's uncorked, with
+// the callbacks of all of them called once the combined write has completed
+int main(int argc, char** argv) {
+  alarm(2);
+  const std::string endpoint = test_endpoint();
+  std::string order;
+
+  channel server = channel::listen(endpoint, [&](error err, channel ch) {
+    assert_null(err);
+    ch.read(4096, [=](error err, data d) {
+      assert_null(err);
+      if (d == nullptr) {
+        ch.close();
+        return false;
+      }
+      ch.write(d); // echo
+      return true;
+    });
+  });
+  assert_not_null(server);
+
+  channel::connect(endpoint, [&](error err, channel ch) {
+    assert_null(err);
+
+    // Header and payload as separate buffers. Corks nest, and nothing is sent until the last one
+    // is undone.
+    ch.cork();
+    ch.cork();
+    ch.write("Hello ", 6, [&](error err) {
+      assert_null(err);
+      order += 'a';
+    });
+    std::vector<data> bufs;
+    bufs.push_back(create_data(5));
+    memcpy(bufs[0]->bytes(), "world", 5);
+    bufs[0]->set_size(5);
+    ch.write(bufs, [&](error err) {
+      assert_null(err);
+      order += 'b';
+    });
+    ch.uncork();
+    assert_eq(ch.write_queue_size(), 11u);
+    ch.uncork();
+
+    // The callback of a write with nothing to write is called as well
+    ch.cork();
+    ch.write(std::vector<data>(), [&](error err) {
+      assert_null(err);
+      order += 'c';
+    });
+    ch.uncork();
+
+    auto received = std::make_shared<std::string>();
+    ch.read(4096, [=, &order](error err, data d) {
+      assert_null(err);
+      assert_not_null(d);
+      received->append(d.bytes(), d.size());
+      if (received->size() < 11) {
+        return true;
+      }
+      assert_eq(*received, std::string("Hello world"));
+      ch.close([=, &order]{
+        assert_eq(order.size(), 3u);
+        assert_true(order.find("ab") != std::string::npos);
+        server.close();
+      });
+      return false;
+    });
+  });
+
+  main_loop();
+  return 0;
+}
@@ -0,0 +1,64 @@
+#include "test.h"
+#include <hi/hi.h>
+
+using namespace hi;
+
+// Echo server on two queues, and a client on the main queue
+int main(int argc, char** argv) {
+  alarm(2);
+  const std::string endpoint = test_endpoint();
+  const int nclients = 4;
+  volatile int naccepted = 0;
+  semaphore all_closed;
+
+  queue q1("server1"), q2("server2");
+  q1.resume();
+  q2.resume();
+
+  channel server = channel::listen(std::vector<queue>{q1, q2}, endpoint, [&](error err, channel ch) {
+    assert_null(err);
+    assert_true(q1.is_current() || q2.is_current());
+    hi_atomic_add32(&naccepted, 1);
+    ch.read(4096, [=](error err, data d) {
+      assert_null(err);
+      if (d == nullptr) {
+        ch.close();
+        return false;
+      }
+      ch.write(d); // echo
+      return true;
+    });
+  });
+  assert_not_null(server);
+
+  for (int i = 0; i != nclients; ++i) {
+    channel::connect(endpoint, [&](error err, channel ch) {
+      assert_null(err);
+      ch.write("Hello world", 11);
+      auto received = std::make_shared<std::string>();
+      ch.read(4096, [=, &all_closed](error err, data d) {
+        assert_null(err);
+        assert_not_null(d);
+        received->append(d.bytes(), d.size());
+        if (received->size() < 11) {
+          return true;
+        }
+        assert_eq(*received, std::string("Hello world"));
+        ch.close([&]{ all_closed.signal(); });
+        return false;
+      });
+    });
+  }
+
+  main_queue().async([&]{
+    // Wait for all clients in the background so the main queue can keep processing events
+    hi::async([&]{
+      for (int i = 0; i != nclients; ++i) { all_closed.wait(); }
+      main_queue().async([&]{ server.close(); });
+    });
+  });
+
+  main_loop();
+  assert_eq(naccepted, nclients);
+  return 0;
+}
@@ -0,0 +1,97 @@
+#include "test.h"
+#include <hi/hi.h>
+
+using namespace hi;
+
+// Echo server that closes a connection when it receives "bye", and a pool of at most two channels
+// to it.
+int main(int argc, char** argv) {
+  alarm(10);
+  const std::string endpoint = test_endpoint();
+  volatile int naccepted = 0;
+
+  channel server = channel::listen(endpoint, [&](error err, channel ch) {
+    assert_null(err);
+    ++naccepted;
+    ch.read(4096, [=](error err, data d) {
+      if (d == nullptr || std::string(d.bytes(), d.size()) == "bye") {
+        ch.close();
+        return false;
+      }
+      ch.write(d); // echo
+      return true;
+    });
+  });
+  assert_not_null(server);
+
+  // The idle timeout is long enough for the first phases to finish before it's reached
+  channel_pool pool(main_queue(), 2, 2);
+
+  // Calls `then` once `cond` holds, checking every 10 ms
+  auto wait_until = [](fun<bool()> cond, fun<void()> then) {
+    auto poll = std::make_shared<timer>();
+    *poll = main_queue().every(0.01, [=]{
+      if (cond()) {
+        poll->cancel();
+        *poll = nullptr;
+        then();
+      }
+    });
+  };
+
+  // Acquire, send "ping", read the echo and release. `done` is called once the channel is back in
+  // the pool.
+  auto ping = [&](fun<void()> done) {
+    pool.acquire(endpoint, [&, done](error err, channel ch) {
+      assert_null(err);
+      ch.write("ping", 4);
+      ch.read(4096, [&, done, ch](error err, data d) {
+        assert_null(err);
+        assert_eq(std::string(d.bytes(), d.size()), std::string("ping"));
+        pool.release(ch);
+        main_queue().async(done);
+        return false;
+      });
+    });
+  };
+
+  fun<void()> phase2, phase3;
+
+  // Phase 1: six concurrent pings share two connections
+  int npinged = 0;
+  for (int i = 0; i != 6; ++i) {
+    ping([&]{
+      if (++npinged == 6) {
+        assert_eq(naccepted, 2);
+        assert_eq(pool.idle_count(), 2u);
+        phase2();
+      }
+    });
+  }
+
+  // Phase 2: the server closes an idle channel, which the pool notices
+  phase2 = [&]{
+    pool.acquire(endpoint, [&](error err, channel ch) {
+      assert_null(err);
+      assert_eq(pool.idle_count(), 1u);
+      ch.write("bye", 3);
+      pool.release(ch);
+      assert_eq(pool.idle_count(), 2u);
+      wait_until([&]{ return pool.idle_count() == 1; }, phase3);
+    });
+  };
+
+  // Phase 3: idle channels time out
+  phase3 = [&]{
+    wait_until([&]{ return pool.idle_count() == 0; }, [&]{
+      ping([&]{
+        assert_eq(naccepted, 3);
+        pool = nullptr;
+        server.close();
+      });
+    });
+  };
+
+  main_loop();
+  return 0;
+}
@@ -0,0 +1,101 @@
+#include "test.h"
+#include <hi/hi.h>
+
+using namespace hi;
+
+// A server that never answers, except for "tick" which it answers with three "t"s, 20ms apart.
+// Clients time out reading from it, idling on it, and connecting to it with TLS, which it doesn't
+// speak.
+int main(int argc, char** argv) {
+  alarm(5);
+  const std::string endpoint = test_endpoint();
+  volatile int nclosed = 0; // connections closed by clients
+
+  channel server = channel::listen(endpoint, [&](error err, channel ch) {
+    assert_null(err);
+    ch.read(4096, [&, ch](error err, data d) {
+      if (d == nullptr) {
+        ++nclosed;
+        ch.close();
+        return false;
+      }
+      if (std::string(d.bytes(), d.size()) == "tick") {
+        auto n = std::make_shared<int>(0);
+        auto t = std::make_shared<timer>();
+        *t = main_queue().every(0.02, [=]{
+          ch.write("t", 1);
+          if (++*n == 3) {
+            t->cancel();
+            *t = nullptr;
+          }
+        });
+      }
+      return true;
+    });
+  });
+  assert_not_null(server);
+
+  fun<void()> phase2, phase3, phase4;
+
+  // Phase 1: a read that receives nothing
+  channel::connect(endpoint, [&](error err, channel ch) {
+    assert_null(err);
+    ch.set_read_timeout(0.05);
+    ch.read(4096, [&, ch](error err, data d) {
+      assert_not_null(err);
+      assert_true(err.timed_out());
+      ch.close();
+      phase2();
+      return false;
+    });
+  });
+
+  // Phase 2: data arriving within the timeout keeps the read going
+  phase2 = [&]{
+    channel::connect(endpoint, [&](error err, channel ch) {
+      assert_null(err);
+      ch.set_read_timeout(0.05);
+      ch.write("tick", 4);
+      auto received = std::make_shared<std::string>();
+      ch.read(4096, [&, ch, received](error err, data d) {
+        if (err != nullptr) {
+          assert_true(err.timed_out());
+          assert_eq(*received, std::string("ttt"));
+          ch.close();
+          phase3();
+          return false;
+        }
+        received->append(d.bytes(), d.size());
+        return true;
+      });
+    });
+  };
+
+  // Phase 3: an idle channel is closed although nothing refers to it
+  phase3 = [&]{
+    channel::connect(endpoint, [&](error err, channel ch) {
+      assert_null(err);
+      ch.set_idle_timeout(0.05);
+      main_queue().after(0.2, [&]{
+        assert_eq(nclosed, 3);
+        phase4();
+      });
+    });
+  };
+
+  // Phase 4: a TLS handshake that never completes
+  phase4 = [&]{
+    channel::connect(main_queue(), endpoint, tls_context(), 0.05, [&](error err, channel ch) {
+      assert_not_null(err);
+      assert_true(err.timed_out());
+      assert_null(ch);
+      main_queue().after(0.05, [&]{
+        assert_eq(nclosed, 4);
+        server.close();
+      });
+    });
+  };
+
+  main_loop();
+  return 0;
+}
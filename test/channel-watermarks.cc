@@ -0,0 +1,72 @@
+#include "test.h"
+#include <hi/hi.h>
+
+using namespace hi;
+
+// A client writes to a server that doesn't read until the client's write queue is full. Once the
+// server reads, the queue drains below the low watermark and the client is told to resume.
+int main(int argc, char** argv) {
+  alarm(5);
+  const std::string endpoint = test_endpoint();
+  const size_t chunk_size = 1024 * 1024;
+  const size_t high = 4 * chunk_size;
+  const size_t low = chunk_size;
+  channel server_ch;
+  volatile int ndrained = 0;
+  int nready = 0;
+  channel server;
+
+  // Once the connection has been accepted and the client's write queue is full, the server reads
+  // everything until the client closes
+  auto ready = [&]{
+    if (++nready != 2) {
+      return;
+    }
+    server_ch.read(65536, [&](error err, data d) {
+      if (err != nullptr || d == nullptr) {
+        server_ch.close();
+        server.close();
+        return false;
+      }
+      return true;
+    });
+  };
+
+  server = channel::listen(endpoint, [&](error err, channel ch) {
+    assert_null(err);
+    server_ch = ch;
+    ready();
+  });
+  assert_not_null(server);
+
+  channel::connect(endpoint, [&](error err, channel ch) {
+    assert_null(err);
+    data chunk = create_data(chunk_size);
+    memset(chunk->bytes(), 'x', chunk_size);
+    chunk->set_size(chunk_size);
+
+    ch.set_write_watermarks(high, low, [&, ch, chunk]{
+      assert_false(ch.write_queue_full());
+      assert_true(ch.write_queue_size() <= low);
+      ++ndrained;
+      // Written after everything queued before it
+      ch.write(chunk, [=](error err) {
+        assert_null(err);
+        ch.close();
+      });
+    });
+
+    // The socket buffers take a few MB at most before writes start to queue up
+    for (int i = 0; i != 256 && !ch.write_queue_full(); ++i) {
+      ch.write(chunk);
+    }
+    assert_true(ch.write_queue_full());
+    assert_true(ch.write_queue_size() >= high);
+    assert_eq(ndrained, 0);
+    ready();
+  });
+
+  main_loop();
+  assert_eq(ndrained, 1);
+  return 0;
+}
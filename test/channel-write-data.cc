@@ -0,0 +1,60 @@
+#include "test.h"
+#include <hi/hi.h>
+
+using namespace hi;
+
+// A client writes a large data object, and a slice of it, without keeping references of its own.
+// The write retains them until they have been sent.
+int main(int argc, char** argv) {
+  alarm(5);
+  const std::string endpoint = test_endpoint();
+  const size_t size = 4 * 1024 * 1024;
+  volatile int nwritten = 0;
+
+  channel server = channel::listen(endpoint, [&](error err, channel ch) {
+    assert_null(err);
+    auto nreceived = std::make_shared<size_t>(0);
+    ch.read(65536, [&, ch, nreceived](error err, data d) {
+      assert_null(err);
+      assert_not_null(d);
+      for (size_t i = 0; i != d.size(); ++i) {
+        size_t offset = *nreceived + i;
+        // The whole data followed by its first 100 bytes
+        size_t expected = (offset < size) ? offset : offset - size;
+        assert_eq(d.bytes()[i], (char)(expected % 251));
+      }
+      *nreceived += d.size();
+      if (*nreceived < size + 100) {
+        return true;
+      }
+      assert_eq(*nreceived, size + 100);
+      ch.close();
+      server.close();
+      return false;
+    });
+  });
+  assert_not_null(server);
+
+  channel::connect(endpoint, [&](error err, channel ch) {
+    assert_null(err);
+    data d = create_data(size);
+    for (size_t i = 0; i != size; ++i) {
+      d->bytes()[i] = (char)(i % 251);
+    }
+    d->set_size(size);
+    ch.write(d, [&](error err) {
+      assert_null(err);
+      ++nwritten;
+    });
+    ch.write(d.slice(0, 100), [=, &nwritten](error err) {
+      assert_null(err);
+      assert_eq(nwritten, 1);
+      ++nwritten;
+      ch.close();
+    });
+  });
+
+  main_loop();
+  assert_eq(nwritten, 2);
+  return 0;
+}
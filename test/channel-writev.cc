@@ -0,0 +1,56 @@
+#include "test.h"
+#include <hi/hi.h>
+
+using namespace hi;
+
+// A client writes many buffers and slices in one vectored write to a server that checks what it
+// receives. The buffers are only referenced by the write once it has been made.
+int main(int argc, char** argv) {
+  alarm(2);
+  const std::string endpoint = test_endpoint();
+  const int nbufs = 20; // more than fit in the write's inline iovec array
+  std::string expected;
+  volatile int nwritten = 0;
+
+  std::vector<data> bufs;
+  data whole = create_data(26);
+  memcpy(whole->bytes(), "abcdefghijklmnopqrstuvwxyz", 26);
+  whole->set_size(26);
+  for (int i = 0; i != nbufs; ++i) {
+    bufs.push_back(whole.slice(i % 26, 1 + i % 5));
+    expected.append(bufs.back().bytes(), bufs.back().size());
+  }
+  whole = nullptr;
+
+  channel server = channel::listen(endpoint, [&](error err, channel ch) {
+    assert_null(err);
+    auto received = std::make_shared<std::string>();
+    ch.read(4096, [&, ch, received](error err, data d) {
+      assert_null(err);
+      assert_not_null(d);
+      received->append(d.bytes(), d.size());
+      if (received->size() < expected.size()) {
+        return true;
+      }
+      assert_eq(*received, expected);
+      ch.close();
+      server.close();
+      return false;
+    });
+  });
+  assert_not_null(server);
+
+  channel::connect(endpoint, [&](error err, channel ch) {
+    assert_null(err);
+    ch.write(std::move(bufs), [=, &nwritten](error err) {
+      assert_null(err);
+      ++nwritten;
+      ch.close();
+    });
+    bufs.clear();
+  });
+
+  main_loop();
+  assert_eq(nwritten, 1);
+  return 0;
+}
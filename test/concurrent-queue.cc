@@ -0,0 +1,39 @@
+#include "test.h"
+#include <hi/hi.h>
+
+using namespace hi;
+
+int main(int argc, char** argv) {
+  concurrent_queue q("cq", 4);
+  assert_eq_cstr(q.label().c_str(), "cq");
+  assert_eq(q.width(), 4u);
+  assert_false(q.is_current());
+  alarm(1);
+
+  // Blocks enqueued before resume() are held until the queue is resumed
+  semaphore sem;
+  int N = 100;
+  volatile int count = 0;
+  for (int i = 0; i != N; ++i) {
+    q.async([&]{
+      assert_true(q.is_current());
+      hi_atomic_add32(&count, 1);
+      sem.signal();
+    });
+  }
+  q.resume();
+  for (int i = 0; i != N; ++i) {
+    sem.wait();
+  }
+  assert_eq(count, N);
+
+  // Two blocks that each wait for the other would deadlock on a serial queue
+  semaphore a, b, done;
+  q.async([=]{ a.signal(); b.wait(); done.signal(); });
+  q.async([=]{ b.signal(); a.wait(); done.signal(); });
+  done.wait();
+  done.wait();
+  print("parallel blocks completed");
+
+  return 0;
+}
@@ -0,0 +1,37 @@
+#include "test.h"
+#include <hi/hi.h>
+
+using namespace hi;
+
+int main(int argc, char** argv) {
+  data d = create_data(100);
+  assert_not_null(d);
+  assert_eq(d.size(), 0u);
+  assert_true(d.capacity() >= 100u);
+  memcpy(d->bytes(), "Hello world", 11);
+  d->set_size(11);
+
+  // Slices reference the bytes of the original data
+  data s1 = d.slice(6, 5);
+  assert_eq(s1.size(), 5u);
+  assert_true(s1.bytes() == d.bytes() + 6);
+  assert_eq(std::string(s1.bytes(), s1.size()), std::string("world"));
+
+  // Slicing a slice
+  data s2 = s1.slice(1, 3);
+  assert_eq(std::string(s2.bytes(), s2.size()), std::string("orl"));
+
+  // Slices keep the original bytes alive
+  d = nullptr;
+  s1 = nullptr;
+  assert_eq(std::string(s2.bytes(), s2.size()), std::string("orl"));
+
+  // Data that takes ownership over an existing buffer
+  char* buf = (char*)malloc(16);
+  memcpy(buf, "abc", 3);
+  data d2 = create_data(buf, 3, 16);
+  assert_eq(d2.bytes(), buf);
+  assert_eq(std::string(d2.slice(1, 2).bytes(), 2), std::string("bc"));
+
+  return 0;
+}
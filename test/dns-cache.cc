@@ -0,0 +1,61 @@
+#include "test.h"
+#include <hi/hi.h>
+
+using namespace hi;
+
+// Connects by host name from two queues at once, sharing lookups through the DNS cache, then
+// connects again from the cache, and once more after clearing it.
+int main(int argc, char** argv) {
+  alarm(5);
+  const std::string port = test_port();
+  const int nclients = 8;
+  volatile int nconnected = 0;
+
+  channel server = channel::listen("tcp:127.0.0.1:" + port, [](error err, channel ch) {
+    assert_null(err);
+    ch.close();
+  });
+  assert_not_null(server);
+
+  queue q("clients");
+  q.resume();
+
+  fun<void()> phase2, phase3;
+  auto on_connect = [&](error err, channel ch) {
+    assert_null(err);
+    assert_not_null(ch);
+    ch.close();
+    if (hi_atomic_add_fetch(&nconnected, 1) == nclients * 2) {
+      main_queue().async(phase2);
+    }
+  };
+
+  // Phase 1: concurrent lookups from the main queue and from `q`
+  for (int i = 0; i != nclients; ++i) {
+    channel::connect("tcp:localhost:" + port, on_connect);
+    channel::connect(q, "tcp:localhost:" + port, on_connect);
+  }
+
+  // Phase 2: cached
+  phase2 = [&]{
+    channel::connect("tcp:localhost:" + port, [&](error err, channel ch) {
+      assert_null(err);
+      ch.close();
+      clear_dns_cache();
+      phase3();
+    });
+  };
+
+  // Phase 3: looked up again
+  phase3 = [&]{
+    channel::connect("tcp:localhost:" + port, [&](error err, channel ch) {
+      assert_null(err);
+      ch.close();
+      server.close();
+    });
+  };
+
+  main_loop();
+  assert_eq(nconnected, nclients * 2);
+  return 0;
+}
@@ -23,6 +23,9 @@ void HI_NO_INLINE do_work() {
 void check_and_summarize(const char* label) {
   #if !HI_TEST_SUIT_RUNNING
   rsample.delta_dumpn(N, label);
+  queue::alloc_stats st = main_queue().slab_stats();
+  print("  Slab hits: %llu, misses: %llu", (unsigned long long)st.hits,
+        (unsigned long long)st.misses);
   #endif
 }
 
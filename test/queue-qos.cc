@@ -0,0 +1,71 @@
+#include "test.h"
+#include <hi/hi.h>
+#include <sys/resource.h>
+#if HI_TARGET_OS_LINUX
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace hi;
+
+int main(int argc, char** argv) {
+  alarm(2);
+
+  // Blocks waiting to run on a concurrent queue start in order of their QoS class
+  concurrent_queue q("cq", 1);
+  semaphore sem;
+  const qos classes[] = {
+    qos::background, qos::normal, qos::interactive, qos::utility, qos::background,
+    qos::interactive, qos::utility, qos::normal,
+  };
+  const int N = sizeof(classes) / sizeof(classes[0]);
+  std::vector<qos> order;
+  for (int i = 0; i != N; ++i) {
+    qos c = classes[i];
+    q.async(c, [&order, &sem, c]{
+      order.push_back(c);
+      sem.signal();
+    });
+  }
+  q.resume();
+  for (int i = 0; i != N; ++i) {
+    sem.wait();
+  }
+  assert_eq(order.size(), (size_t)N);
+  for (int i = 1; i != N; ++i) {
+    assert_true(order[i - 1] >= order[i]);
+  }
+
+  #if HI_TARGET_OS_LINUX
+  // Threads of lower classes are scheduled with a lower priority than the process. Threads started
+  // from them, here the first of the normal hi::async threads, don't take on their priority.
+  const int base = getpriority(PRIO_PROCESS, 0);
+  auto check_normal = [&]{
+    assert_eq(sched_getscheduler(0), SCHED_OTHER);
+    assert_eq(getpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid)), base);
+    sem.signal();
+  };
+  hi::async(qos::background, [&]{
+    assert_eq(sched_getscheduler(0), SCHED_IDLE);
+    hi::async(check_normal);
+    queue nq("normal");
+    nq.async(check_normal).resume();
+    concurrent_queue ncq("normal", 1);
+    ncq.async(check_normal).resume();
+    sem.signal();
+  });
+  for (int i = 0; i != 4; ++i) {
+    sem.wait();
+  }
+
+  queue uq("utility", qos::utility);
+  uq.async([&]{
+    assert_eq(sched_getscheduler(0), SCHED_BATCH);
+    assert_eq(getpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid)), HI_MIN(base + 10, 19));
+    sem.signal();
+  }).resume();
+  sem.wait();
+  #endif
+
+  return 0;
+}
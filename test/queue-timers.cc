@@ -0,0 +1,60 @@
+#include "test.h"
+#include <hi/hi.h>
+
+using namespace hi;
+
+// One-shot and repeating timers on the main queue and on a background queue, cancelled from the
+// queue itself and from other threads.
+int main(int argc, char** argv) {
+  alarm(5);
+  std::string order;
+
+  // Fire in due order regardless of the order they were scheduled in
+  main_queue().after(0.03, [&]{ order += 'c'; });
+  main_queue().after(0.01, [&]{ order += 'a'; });
+  main_queue().after(0.02, [&]{ order += 'b'; });
+  main_queue().after(0.02, [&]{ order += 'B'; }); // same due time: scheduling order
+
+  // Cancelled before firing
+  timer cancelled = main_queue().after(0.01, [&]{ order += 'x'; });
+  cancelled.cancel();
+  cancelled.cancel(); // no-op
+
+  // Repeats until it cancels itself
+  int nticks = 0;
+  timer ticker;
+  ticker = main_queue().every(0.005, [&]{
+    if (++nticks == 5) {
+      ticker.cancel();
+    }
+  });
+
+  // Scheduled from the main thread onto a background queue, and cancelled from the main thread
+  queue q("timers");
+  q.resume();
+  volatile int nbackground = 0;
+  semaphore background_done;
+  q.after(0.01, [&]{
+    assert_true(q.is_current());
+    hi_atomic_add32(&nbackground, 1);
+    background_done.signal();
+  });
+  timer background_ticker = q.every(0.001, [&]{
+    assert_true(q.is_current());
+  });
+  timer background_cancelled = q.after(0.01, [&]{ hi_atomic_add32(&nbackground, 100); });
+  background_cancelled.cancel();
+
+  main_queue().after(0.05, [&]{
+    background_ticker.cancel();
+    ticker = nullptr; // breaks the cycle between the timer and its function
+  });
+
+  // main_loop returns once no timers are left
+  main_loop();
+  assert_eq(order, std::string("abBc"));
+  assert_eq(nticks, 5);
+  background_done.wait();
+  assert_eq(nbackground, 1);
+  return 0;
+}
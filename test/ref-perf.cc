@@ -0,0 +1,89 @@
+#include "test.h"
+#include <hi/hi.h>
+#include <hi/rusage.h>
+
+using namespace hi;
+
+// Cost of copying references with atomic (HI_REF_MIXIN) and non-atomic (HI_LOCAL_REF_MIXIN)
+// reference counts, directly and through captures of copied functions, plus a check that
+// references copied and dropped concurrently from several threads deallocate exactly once.
+
+const size_t N = 4000000;
+volatile int ndealloc = 0;
+
+struct shared_thing { HI_REF_MIXIN(shared_thing)
+  shared_thing(int);
+};
+struct shared_thing::S : ref_counted {};
+shared_thing::shared_thing(int) : shared_thing(new S) {}
+void shared_thing::dealloc(S* p) { hi_atomic_add32(&ndealloc, 1); delete p; }
+
+struct local_thing { HI_LOCAL_REF_MIXIN(local_thing)
+  local_thing(int);
+};
+struct local_thing::S : local_ref_counted {};
+local_thing::local_thing(int) : local_thing(new S) {}
+void local_thing::dealloc(S* p) { hi_atomic_add32(&ndealloc, 1); delete p; }
+
+template <typename T> void HI_NO_INLINE copy_refs(const T& t, size_t n) {
+  for (size_t i = 0; i != n; ++i) {
+    T copy = t;
+    asm volatile("" : : "r"(copy.self) : "memory"); // keep the copy
+  }
+}
+
+template <typename T> void HI_NO_INLINE copy_captures(const T& t, size_t n) {
+  fun<void()> f = [t]{ asm volatile("" : : "r"(t.self) : "memory"); };
+  for (size_t i = 0; i != n; ++i) {
+    fun<void()> copy = f;
+    copy();
+  }
+}
+
+template <typename T> void measure(const char* label) {
+  T t(0);
+  rusage::sample rs;
+  copy_refs(t, N);
+  #if !HI_TEST_SUIT_RUNNING
+  rs.delta_dumpn(N, label);
+  #endif
+  assert_eq(t.self->__refcount, 1u);
+}
+
+template <typename T> void measure_captures(const char* label) {
+  T t(0);
+  rusage::sample rs;
+  copy_captures(t, N / 4);
+  #if !HI_TEST_SUIT_RUNNING
+  rs.delta_dumpn(N / 4, label);
+  #endif
+  assert_eq(t.self->__refcount, 1u);
+}
+
+int main(int argc, char** argv) {
+  print("N = %zu", N);
+  measure<shared_thing>("Copy atomic reference");
+  measure<local_thing>("Copy local reference");
+  measure_captures<shared_thing>("Copy function capturing atomic reference");
+  measure_captures<local_thing>("Copy function capturing local reference");
+  assert_eq(ndealloc, 4);
+
+  // Concurrent copies, with the last reference dropped by whichever thread finishes last
+  const int nthreads = 4;
+  semaphore done;
+  {
+    shared_thing t(0);
+    for (int i = 0; i != nthreads; ++i) {
+      hi::async([=]() mutable {
+        copy_refs(t, N / 16);
+        t = nullptr;
+        done.signal();
+      });
+    }
+  }
+  for (int i = 0; i != nthreads; ++i) {
+    done.wait();
+  }
+  assert_eq(ndealloc, 5);
+  return 0;
+}
@@ -0,0 +1,57 @@
+#include "test.h"
+#include <hi/hi.h>
+
+using namespace hi;
+
+// A queue waits on a semaphore and sleeps without blocking its thread, running other blocks in
+// the meantime.
+int main(int argc, char** argv) {
+  alarm(5);
+  queue q("q");
+  semaphore sem;
+  semaphore ready;
+  semaphore done;
+  std::string order; // only used on `q`
+
+  q.async([&]{
+    sem.wait([&]{
+      assert_true(q.is_current());
+      order += '2';
+      hi::sleep(0.05, [&]{
+        assert_true(q.is_current());
+        order += '4';
+
+        // Acquired right away
+        semaphore(1).wait([&]{ order += '5'; });
+
+        // A thread blocked in wait() and a continuation both get woken
+        semaphore sem2;
+        hi::async([=]{
+          sem2.wait();
+          done.signal();
+        });
+        sem2.wait([=]{ done.signal(); });
+        sem2.signal();
+        sem2.signal();
+      });
+      q.async([&]{ order += '3'; }); // runs while sleeping
+    });
+    q.async([&]{ // runs while waiting
+      order += '1';
+      ready.signal();
+    });
+  });
+  q.resume();
+
+  ready.wait();
+  sem.signal();
+
+  done.wait();
+  done.wait();
+  q.async([&]{
+    assert_eq(order, std::string("12345"));
+    done.signal();
+  });
+  done.wait();
+  return 0;
+}
@@ -0,0 +1,82 @@
+#include "test.h"
+#include <hi/hi.h>
+
+using namespace hi;
+
+static queue::alloc_stats delta(const queue::alloc_stats& since) {
+  queue::alloc_stats st = main_queue().slab_stats();
+  return queue::alloc_stats{ st.hits - since.hits, st.misses - since.misses };
+}
+
+// Records allocated and freed on the same queue are recycled through the queue's slab, and records
+// too large for the slab bypass it
+int main(int argc, char** argv) {
+  alarm(2);
+  const size_t N = 100;
+  data d = create_data(16);
+  d->set_size(16);
+
+  // Slices are records. The first round of N live slices finds one freed record at most, while the
+  // second round finds all N.
+  d.slice(0, 1);
+  queue::alloc_stats st = main_queue().slab_stats();
+  std::vector<data> slices;
+  for (size_t i = 0; i != N; ++i) {
+    slices.push_back(d.slice(0, 1));
+  }
+  assert_eq(delta(st).hits, 1u);
+  assert_eq(delta(st).misses, N - 1);
+  slices.clear();
+  st = main_queue().slab_stats();
+  for (size_t i = 0; i != N; ++i) {
+    slices.push_back(d.slice(0, 1));
+  }
+  assert_eq(delta(st).hits, N);
+  assert_eq(delta(st).misses, 0u);
+  slices.clear();
+
+  // Blocks are records too. Each block is freed after it has run, so its record is reused by the
+  // next one.
+  main_queue().async([]{});
+  main_next_nowait();
+  st = main_queue().slab_stats();
+  for (size_t i = 0; i != N; ++i) {
+    main_queue().async([]{});
+    main_next_nowait();
+  }
+  assert_eq(delta(st).hits, N);
+  assert_eq(delta(st).misses, 0u);
+
+  // A write of copied bytes is a record holding the bytes, which bypasses the slab once it's
+  // larger than a slab record can be
+  const std::string endpoint = test_endpoint();
+  channel server = channel::listen(endpoint, [&](error err, channel ch) {
+    assert_null(err);
+    ch.read(4096, [&, ch](error err, data d) {
+      if (d == nullptr) {
+        ch.close();
+        server.close();
+        return false;
+      }
+      return true;
+    });
+  });
+  assert_not_null(server);
+  channel::connect(endpoint, [&](error err, channel ch) {
+    assert_null(err);
+    std::string small(10, 'x'), large(4096, 'x');
+    queue::alloc_stats st = main_queue().slab_stats();
+    ch.write(small.data(), small.size());
+    assert_eq(delta(st).hits + delta(st).misses, 1u);
+    st = main_queue().slab_stats();
+    ch.write(large.data(), large.size(), [=](error err) {
+      assert_null(err);
+      ch.close();
+    });
+    assert_eq(delta(st).hits, 0u);
+    assert_eq(delta(st).misses, 0u);
+  });
+
+  main_loop();
+  return 0;
+}
@@ -0,0 +1,50 @@
+#include "test.h"
+#include <hi/hi.h>
+#include <thread>
+
+using namespace hi;
+
+// More threads than cores increment a counter under a Spinlock, so that lockers have to wait, and
+// those that wait long enough go to sleep. Fewer threads do the same with a TicketLock, which hands
+// the lock over in order and so waits for preempted lockers.
+int main(int argc, char** argv) {
+  alarm(10);
+  const int nthreads = 16;
+  const int N = 20000;
+  const int nticket_threads = 2;
+
+  Spinlock lock = SB_SPINLOCK_INIT;
+  TicketLock ticket_lock;
+  uint64_t count = 0;
+  uint64_t ticket_count = 0;
+
+  assert_true(spinlock_try_lock(lock));
+  assert_false(spinlock_try_lock(lock));
+  spinlock_unlock(lock);
+
+  semaphore done;
+  for (int t = 0; t != nthreads; ++t) {
+    std::thread([&, t]{
+      for (int i = 0; i != N; ++i) {
+        { ScopedSpinlock l(lock); ++count; }
+        if (t < nticket_threads) {
+          ScopedTicketLock l(ticket_lock);
+          ++ticket_count;
+        }
+      }
+      done.signal();
+    }).detach();
+  }
+  for (int t = 0; t != nthreads; ++t) {
+    done.wait();
+  }
+
+  assert_eq(count, (uint64_t)nthreads * N);
+  assert_eq(ticket_count, (uint64_t)nticket_threads * N);
+  assert_eq(lock, 0);
+  assert_eq(ticket_lock.next, ticket_lock.serving);
+  HI_UNUSED spinlock_counters st = spinlock_stats();
+  print("Contended: %llu, parked: %llu", (unsigned long long)st.contended,
+        (unsigned long long)st.parked);
+  return 0;
+}
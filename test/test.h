@@ -30,6 +30,7 @@
 // ------------------------------
 #ifdef __cplusplus
 #include <iostream>
+#include <string>
 
 namespace hi {
 
@@ -103,6 +104,16 @@ inline void HI_UNUSED _assert_eq_cstr(
 #define assert_null(a) ::hi::_assert_null((a), #a, HI_FILENAME, __LINE__)
 #define assert_not_null(a) ::hi::_assert_not_null((a), #a, HI_FILENAME, __LINE__)
 
+// TCP port for tests to listen on, derived from the process ID so that tests running at the same
+// time don't collide, and a loopback endpoint with that port
+inline std::string HI_UNUSED test_port() {
+  return std::to_string(20000 + (getpid() % 20000));
+}
+
+inline std::string HI_UNUSED test_endpoint() {
+  return "tcp:127.0.0.1:" + test_port();
+}
+
 } // namespace
 #endif // __cplusplus
 